@@ -0,0 +1,338 @@
+/**
+ * @file bench.c
+ * @brief Headless benchmarks for kilo's load, render and edit paths, so that
+ *        they can be run and compared without a terminal. kilo.c is built in
+ *        without its main(), against a fake terminal: frames are drawn to
+ *        /dev/null, and keys are fed straight into E.input.
+ *
+ * Usage: ./bench [-s MB] [-r ROWS] [-c COLS] [-p PAGES] [-k KEYFILE] [FILE]
+ *
+ * Without a FILE, a synthetic C file of MB MiB (1024 by default) is written to
+ * /tmp and opened, so that the highlighter has something to do. The same
+ * arguments always make the same file. The scenarios are run in order:
+ *
+ *   open   Time to the first screen, and then to the whole file being indexed
+ *          and highlighted.
+ *   page   PAGE_DOWN through the file PAGES times (1000 by default), drawing
+ *          every screen.
+ *   keys   Replay a key stream, drawing after every key. KEYFILE holds the raw
+ *          bytes a terminal sends (recorded with `script -I`, say); without
+ *          one, a built-in stream of typing, moving, deleting, undoing and
+ *          searching is used. Ctrl-Q and Ctrl-S are skipped.
+ *
+ * Background work that keys queue up (searching, highlighting) is finished
+ * between keys, off the clock, so that every run does the same work.
+ */
+
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+#include <sys/resource.h>
+
+/** @brief Default size of the synthetic file, in MiB. */
+#define BENCH_SIZE_MB 1024
+
+/** @brief Default number of pages for the page scenario. */
+#define BENCH_PAGES 1000
+
+/** @brief Default size of the fake terminal. */
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+/** @brief How far ahead of the key being handled E.input is kept filled. */
+#define BENCH_LOOKAHEAD 64
+
+/**
+ * @brief Where the report goes. The editor's own stdout is /dev/null.
+ */
+FILE *report;
+
+/**
+ * @brief Get the time from a monotonic clock, in seconds.
+ */
+double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Get the peak resident set size so far, in MiB.
+ */
+long benchPeakRss() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss / 1024;
+}
+
+/**
+ * @brief A growable array of latencies, in seconds.
+ */
+struct benchSamples {
+  double *v;
+  size_t n;
+  size_t cap;
+};
+
+/**
+ * @brief Add a latency to a set of samples.
+ */
+void benchSample(struct benchSamples *s, double t) {
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->v = realloc(s->v, sizeof(double) * s->cap);
+    if (s->v == NULL) die("realloc");
+  }
+  s->v[s->n++] = t;
+}
+
+int benchCompare(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print a scenario's throughput and latency percentiles, along with the
+ *        peak RSS so far, and empty the samples.
+ * @param name Name of the scenario.
+ * @param s The latencies of each operation in the scenario.
+ */
+void benchReport(const char *name, struct benchSamples *s) {
+  double total = 0;
+  size_t i;
+
+  if (s->n == 0) return;
+
+  qsort(s->v, s->n, sizeof(double), benchCompare);
+  for (i = 0; i < s->n; i++) total += s->v[i];
+
+#define P(p) (s->v[(size_t) ((p) * (s->n - 1))] * 1e6)
+  fprintf(report, "%-6s %8zu ops %10.0f ops/s", name, s->n, s->n / total);
+  fprintf(report, "   p50 %8.1fus  p90 %8.1fus  p99 %8.1fus  max %8.1fus",
+      P(0.5), P(0.9), P(0.99), P(1.0));
+  fprintf(report, "   peak RSS %ld MiB\n", benchPeakRss());
+#undef P
+
+  s->n = 0;
+}
+
+/**
+ * @brief Write a synthetic C file: a shuffle of typical lines, with keywords,
+ *        strings, numbers, tabs and comments (some over more than one line).
+ * @param fd Where to write it.
+ * @param size Roughly how many bytes to write. Whole lines are written, so it
+ *             may go a little over.
+ */
+void benchSynthesize(int fd, size_t size) {
+  static const char *lines[] = {
+    "int main(int argc, char *argv[]) {",
+    "\tfor (int i = 0; i < 1024; i++) {",
+    "\t\tcount += buf[i] * 31 + 7;",
+    "\t}",
+    "\t/* a comment that goes on for a while, like comments do */",
+    "\tprintf(\"%d items\\n\", count);",
+    "\tif (x == 0x1f) return -1; // bail out early",
+    "/* a comment that starts on one line",
+    "   and ends on the next */",
+    "}",
+    "",
+    "static const char *name = \"kilo\";",
+    "\twhile (p < end && *p != '\\n') p++;",
+  };
+  size_t nlines = sizeof(lines) / sizeof(lines[0]);
+
+  struct abuf ab = ABUF_INIT;
+  unsigned int seed = 1;
+  size_t written = 0;
+
+  while (written < size) {
+    seed = seed * 1103515245 + 12345;
+    size_t i = (seed >> 16) % nlines;
+
+    // Multi-line comments always come in one piece.
+    if (i == 8) i = 7;
+    abAppend(&ab, lines[i], strlen(lines[i]));
+    abAppend(&ab, "\n", 1);
+    if (i == 7) {
+      abAppend(&ab, lines[8], strlen(lines[8]));
+      abAppend(&ab, "\n", 1);
+    }
+
+    if (ab.len >= KILO_READ_BLOCK || written + ab.len >= size) {
+      if (write(fd, ab.b, ab.len) != (ssize_t) ab.len) die("write");
+      written += ab.len;
+      abReset(&ab);
+    }
+  }
+
+  abFree(&ab);
+}
+
+/**
+ * @brief The default key stream for the keys scenario.
+ * @param ab Where to put it.
+ */
+void benchDefaultKeys(struct abuf *ab) {
+  int i;
+
+#define KEYS(n, s) for (i = 0; i < (n); i++) abAppend(ab, s, strlen(s))
+  KEYS(100, "\tcount += 1; /* typed */\r");
+  KEYS(50, "\x1b[A");
+  KEYS(50, "\x1b[C");
+  KEYS(300, "\x7f");
+  KEYS(40, "\x1a");
+  KEYS(40, "\x19");
+  KEYS(20, "\x1b[6~");
+  KEYS(20, "\x1b[5~");
+  KEYS(1, "\x06" "count");
+  KEYS(10, "\x1b[B");
+  KEYS(1, "\r");
+#undef KEYS
+}
+
+/**
+ * @brief Replay a key stream through editorProcessKeypress(), drawing the
+ *        screen after each key.
+ * @param keys The bytes of the stream, as a terminal would send them.
+ * @param len Length of the stream.
+ * @param s Gets the time taken to handle and draw each key.
+ */
+void benchReplay(const char *keys, size_t len, struct benchSamples *s) {
+  size_t pos = 0;
+
+  while (1) {
+    // Keep E.input topped up, so that escape sequences arrive whole.
+    while (E.input.len < BENCH_LOOKAHEAD && pos < len) {
+      unsigned char c = keys[pos++];
+      if (c == CTRL_KEY('q') || c == CTRL_KEY('s')) continue;
+
+      E.input.buf[(E.input.head + E.input.len) % KILO_INPUT_BUFSIZE] = c;
+      E.input.len++;
+    }
+    if (E.input.len == 0) break;
+
+    double t = benchNow();
+    editorProcessKeypress();
+    editorRefreshScreen();
+    benchSample(s, benchNow() - t);
+
+    while (E.loop.nidle > 0) editorRunIdle();
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = (size_t) BENCH_SIZE_MB << 20;
+  int rows = BENCH_ROWS;
+  int cols = BENCH_COLS;
+  int pages = BENCH_PAGES;
+  const char *keyfile = NULL;
+  char tmp[] = "/tmp/kilo-bench-XXXXXX.c";
+  char *path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:r:c:p:k:")) != -1) {
+    switch (opt) {
+      case 's': size = (size_t) atol(optarg) << 20; break;
+      case 'r': rows = atoi(optarg); break;
+      case 'c': cols = atoi(optarg); break;
+      case 'p': pages = atoi(optarg); break;
+      case 'k': keyfile = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-s MB] [-r ROWS] [-c COLS] [-p PAGES] "
+            "[-k KEYFILE] [FILE]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  struct abuf keys = ABUF_INIT;
+  if (keyfile != NULL) {
+    int fd = open(keyfile, O_RDONLY);
+    if (fd == -1) {
+      perror(keyfile);
+      return 1;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) abAppend(&keys, buf, n);
+    close(fd);
+  } else {
+    benchDefaultKeys(&keys);
+  }
+
+  if (optind < argc) {
+    path = argv[optind];
+  } else {
+    int fd = mkstemps(tmp, 2);
+    if (fd == -1) {
+      perror("mkstemps");
+      return 1;
+    }
+
+    fprintf(stderr, "writing %zu MiB to %s...\n", size >> 20, tmp);
+    benchSynthesize(fd, size);
+    close(fd);
+    path = tmp;
+  }
+
+  // The fake terminal: frames go to /dev/null, and stdin is a pipe that never
+  // has anything in it (but never hits EOF, either), so waiting for the rest
+  // of an escape sequence times out the way it would on a real terminal.
+  int in[2];
+  int null = open("/dev/null", O_WRONLY);
+  if (pipe(in) == -1 || null == -1) die("fake terminal");
+
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  if (report == NULL) die("fdopen");
+  dup2(in[0], STDIN_FILENO);
+  dup2(null, STDOUT_FILENO);
+
+  initEditorWithSize(rows, cols);
+
+  struct benchSamples s = { NULL, 0, 0 };
+
+  // open: the first screen, then the whole index, then all the highlighting.
+  double t = benchNow();
+  editorOpen(path);
+  editorRefreshScreen();
+  double first = benchNow() - t;
+
+  t = benchNow();
+  while (E.indexpos != NULL) {
+    if (E.pool != NULL) {
+      editorIndexWait();
+    } else {
+      editorIndexMore(KILO_INDEX_SLICE);
+    }
+  }
+  double indexed = benchNow() - t;
+
+  t = benchNow();
+  while (editorSyntaxIdle());
+  double highlighted = benchNow() - t;
+
+  double mib = E.mapsize / (1024.0 * 1024.0);
+  fprintf(report, "%.1f MiB, %d rows, %dx%d terminal\n\n", mib, E.numrows,
+      cols, rows);
+  fprintf(report, "open   first screen %.2f ms, "
+      "indexed in %.3f s (%.1f MiB/s), "
+      "highlighted in %.3f s (%.1f MiB/s)   peak RSS %ld MiB\n",
+      first * 1e3, indexed, mib / indexed, highlighted,
+      E.syntax ? mib / highlighted : 0.0, benchPeakRss());
+
+  // page: straight down the file.
+  struct abuf keys2 = ABUF_INIT;
+  int i;
+  for (i = 0; i < pages; i++) abAppend(&keys2, "\x1b[6~", 4);
+  benchReplay(keys2.b, keys2.len, &s);
+  benchReport("page", &s);
+
+  // keys: from the top of the file.
+  E.cx = E.cy = 0;
+  benchReplay(keys.b, keys.len, &s);
+  benchReport("keys", &s);
+
+  if (path == tmp) unlink(tmp);
+  return 0;
+}
@@ -6,24 +6,221 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 /*** DEFINES ***/
 
 #define KILO_VERSION "0.0.1"
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+#ifndef IOV_MAX
+/**
+ * @brief Most iovecs writev() takes at once, where <limits.h> doesn't say.
+ */
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @brief Most rows each chunk of E.lineoff holds. Inserting or deleting a row
+ *        only moves the rest of its chunk, and the chunk directory.
+ */
+#define KILO_CHUNK_ROWS 1024
+
+/**
+ * @brief Number of erows in each block of E.rowpool.
+ */
+#define KILO_POOL_BLOCK 1024
+
+/**
+ * @brief Size of each chunk in the row text arena. Rows longer than this get a
+ *        chunk of their own.
+ */
+#define KILO_ARENA_CHUNK_SIZE (1 << 20)
+
+/**
+ * @brief How much to read() at a time when loading a file that can't be mapped.
+ */
+#define KILO_READ_BLOCK (1 << 20)
+
+/**
+ * @brief Roughly how many bytes of a mapped file are indexed into E.lineoff per
+ *        slice of background work, once the first screen's been shown.
+ */
+#define KILO_INDEX_SLICE (4 << 20)
+
+/**
+ * @brief Size of the chunks that the indexing worker pool splits big files
+ *        into. Files with less than two chunks left to index after the first
+ *        screen are indexed on the main thread instead.
+ */
+#define KILO_INDEX_CHUNK (64 << 20)
+
+/**
+ * @brief Most threads in the indexing worker pool.
+ */
+#define KILO_MAX_INDEX_THREADS 64
+
+/**
+ * @brief Flag set in an E.lineoff entry once the row it's for has been
+ *        materialized. The rest of the entry is then the row's slot in
+ *        E.rowpool.
+ */
+#define KILO_LINE_LOADED (1ULL << 63)
+
+/**
+ * @brief Flag set in a row's highlighting state in E.lineoff when the row
+ *        needs lexing again, because it's changed or the row before it now
+ *        ends in a different state.
+ */
+#define KILO_HL_DIRTY 0x80
+
+/**
+ * @brief How many rows above and below the screen the kernel's asked to read
+ *        ahead of time, so that scrolling a little doesn't fault pages in.
+ */
+#define KILO_PREFETCH_ROWS 256
+
+/**
+ * @brief How many rows the syntax highlighting idle task brings up to date at
+ *        a time.
+ */
+#define KILO_HL_SLICE 4096
+
+/**
+ * @brief Roughly how many bytes the search idle task scans (or checks old
+ *        matches against a narrowed query in) at a time.
+ */
+#define KILO_SEARCH_SLICE (4 << 20)
+
+/**
+ * @brief How long status messages stay up for, in ms.
+ */
+#define KILO_MSG_TIMEOUT 5000
+
+/**
+ * @brief Longest string that can be typed into a prompt.
+ */
+#define KILO_PROMPT_MAX 256
+
+/**
+ * @brief Edits more than this many ms apart go into separate undo records, so
+ *        that undo goes back a burst of typing at a time.
+ */
+#define KILO_UNDO_GAP 1000
+
+/**
+ * @brief Flag on an undo record whose text was deleted back to front (with
+ *        Backspace), so undoing it should leave the cursor after the text.
+ */
+#define UNDO_BACKWARD (1 << 6)
+
+/**
+ * @brief Flag on an undo record that's undone and redone along with the one
+ *        before it.
+ */
+#define UNDO_GROUP (1 << 7)
+
+/**
+ * @brief Highlight numbers in a filetype.
+ */
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+
+/**
+ * @brief Highlight strings in a filetype.
+ */
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+/**
+ * @brief Smallest gap that's opened up in a row when it has to grow.
+ */
+#define KILO_GAP_MIN 16
+
+/**
+ * @brief Width of a tab stop, in columns.
+ */
+#define KILO_TAB_STOP 8
+
+/**
+ * @brief Number of chars an abuf gets room for the first time it grows.
+ */
+#define KILO_ABUF_INIT_CAP 256
+
+/**
+ * @brief Size of the ring buffer that input from stdin is read into.
+ */
+#define KILO_INPUT_BUFSIZE (1 << 16)
+
+/**
+ * @brief How long to wait (in ms) for the rest of an escape sequence, or for a
+ *        reply from the terminal, before giving up on it.
+ */
+#define KILO_ESC_TIMEOUT 100
+
+/**
+ * @brief Most timers that can be pending in the event loop at once.
+ */
+#define KILO_MAX_TIMERS 8
+
+/**
+ * @brief Most idle tasks that can be queued in the event loop at once.
+ */
+#define KILO_MAX_IDLE 8
+
+/**
+ * @brief Most extra file descriptors the event loop can watch at once.
+ */
+#define KILO_MAX_WATCHES 8
+
+#ifdef KILO_STATS
+/**
+ * @brief Number of buckets in a statsHistogram (enough for values up to 2^36).
+ */
+#define STATS_BUCKETS (16 + 8 * 32)
+
+/**
+ * @brief Where the stats are written on exit, unless $KILO_STATS_FILE says
+ *        otherwise.
+ */
+#define KILO_STATS_FILE "kilo-stats.txt"
+
+/**
+ * @brief Run a statement only if kilo's built with -DKILO_STATS. Otherwise the
+ *        instrumentation isn't compiled in at all.
+ */
+#define STATS(stmt) stmt
+#else
+#define STATS(stmt)
+#endif
+
 /**
  * @brief Control keys, such as arrow keys, for the editor.
  */
 enum editorKey {
+  BACKSPACE = 127,
   ARROW_LEFT = 1000,
   ARROW_RIGHT,
   ARROW_UP,
@@ -35,167 +232,1100 @@ enum editorKey {
   PAGE_DOWN
 };
 
-/*** DATA ***/
+/**
+ * @brief What each column of a row's render is highlighted as.
+ */
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH
+};
 
 /**
- * @brief A row of text.
+ * @brief The lexer state at the end of a row, i.e. what the next row starts
+ *        in. HLSTATE_UNKNOWN is for rows that haven't been highlighted yet.
  */
-typedef struct erow {
-  int size;
-  char *chars;
-} erow;
+enum editorHighlightState {
+  HLSTATE_UNKNOWN = -1,
+  HLSTATE_NORMAL = 0,
+  HLSTATE_MLCOMMENT
+};
 
+#ifdef KILO_STATS
 /**
- * @brief Global editor config struct.
+ * @brief What's measured for each frame.
  */
-struct editorConfig {
-  /** @brief Cursor x position (column). */
-  int cx;
+enum editorStat {
+  /** @brief Time spent in editorProcessKeypress(), in frames with any keys. */
+  STAT_KEYS = 0,
 
-  /** @brief Cursor y position (row). */
-  int cy;
+  /** @brief Time spent in editorDrawRows(). */
+  STAT_DRAW,
+
+  /** @brief Time spent in write()ing the frame, in frames that wrote one. */
+  STAT_WRITE,
+
+  /** @brief Bytes written, in frames that wrote any. */
+  STAT_BYTES,
+
+  /** @brief Number of read() syscalls for input. */
+  STAT_READS,
 
+  STAT_COUNT
+};
+#endif
+
+/**
+ * @brief What an undo record does to the text.
+ */
+enum undoKind {
+  UNDO_INSERT = 0,
+  UNDO_DELETE
+};
+
+/**
+ * @brief Where the bytes behind an erow's chars live.
+ */
+enum erowStorage {
   /**
-   * @brief The height of the window in rows.
+   * @brief chars points straight into the memory-mapped file. It is read-only
+   *        and is *not* NUL-terminated.
    */
-  int screenrows;
+  ROW_MAPPED = 0,
 
   /**
-   * @brief The width of the window in columns.
+   * @brief chars is NUL-terminated and lives in E.arena. It's read-only, and is
+   *        freed along with the rest of the arena.
    */
-  int screencols;
-
-  /** @brief Number of rows of text in this document. */
-  int numrows;
-
-  /** @brief Array of rows in the document. */
-  erow *row;
+  ROW_ARENA,
 
   /**
-   * @brief The original attributes for termios
+   * @brief chars is a heap buffer owned by the row, and is the only kind of
+   *        storage that may hold a gap (see erow).
    */
-  struct termios orig_termios;
+  ROW_HEAP
 };
 
+/*** DATA ***/
+
 /**
- * @brief Main instance of editorConfig.
+ * @brief One chunk of an arena.
  */
-struct editorConfig E;
+struct arenaChunk {
+  /** @brief The previously filled chunk, or NULL. */
+  struct arenaChunk *next;
 
-/*** TERMINAL ***/
+  /** @brief Number of bytes handed out from data. */
+  size_t used;
+
+  /** @brief Number of bytes data can hold. */
+  size_t cap;
+
+  char data[];
+};
 
 /**
- * @brief Print an error message and exit the program.
- * @param s The error message
+ * @brief A bump allocator that hands out memory from large chunks, so that
+ *        things allocated one after the other sit next to each other in memory.
+ *        Individual allocations can't be freed; the whole arena is freed at
+ *        once instead.
  */
-void die(const char *s) {
-  // Clear the screen
-  write(STDOUT_FILENO, "\x1b[2J", 4);
+struct arena {
+  /** @brief The chunk currently being filled, or NULL if nothing's allocated. */
+  struct arenaChunk *head;
+};
 
-  // Position the cursor at the top left
-  write(STDOUT_FILENO, "\x1b[H", 3);
+/**
+ * @brief An empty arena.
+ */
+#define ARENA_INIT { NULL }
 
-  perror(s);
-  exit(1);
-}
+/**
+ * @brief How far an arena had got at some point, to rewind it back to with
+ *        arenaRewind().
+ */
+struct arenaMark {
+  /** @brief The chunk being filled then, or NULL if nothing was allocated. */
+  struct arenaChunk *chunk;
+
+  /** @brief How much of it was used. */
+  size_t used;
+};
 
 /**
- * @brief Reset the terminal's attributes so that the user's shell isn't broken.
+ * @brief A row of text, stored as a gap buffer.
+ *
+ * The row's text is chars[0, gap) followed by chars[gap + gaplen, size +
+ * gaplen). Inserting or deleting at the gap is O(1), and moving the gap costs
+ * only the distance it moves, so typing stays cheap however long the row is.
+ * Rows that haven't been edited have an empty gap at the end (gap == size,
+ * gaplen == 0), so their chars are contiguous.
  */
-void disableRawMode() {
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
-    die("tcsetattr");
-  }
-}
+typedef struct erow {
+  /** @brief Number of chars in the row, not counting the gap. */
+  int size;
+  char *chars;
+
+  /** @brief Offset of the gap within chars. Always between 0 and size. */
+  int gap;
+
+  /** @brief Length of the gap. Only ever non-zero for ROW_HEAP rows. */
+  int gaplen;
+
+  /** @brief One of enum erowStorage. */
+  int storage;
+
+  /**
+   * @brief The row the way it's drawn: tabs are expanded to spaces, and
+   *        control chars are shown as ^X. NULL until editorRowRender() builds
+   *        it, and again whenever the row changes. Rows that don't need
+   *        anything expanding and have no gap in the way point straight at
+   *        chars.
+   */
+  char *render;
+
+  /** @brief Length of render. */
+  int rsize;
+
+  /**
+   * @brief The column of render that each char of the row starts at, plus one
+   *        for the end of the row (size + 1 entries). NULL if every char takes
+   *        up exactly one column.
+   */
+  int *rx;
+
+  /**
+   * @brief One enum editorHighlight per byte of render, or NULL if the row
+   *        hasn't been drawn since it (or the state it starts in) changed.
+   */
+  unsigned char *hl;
+
+  /**
+   * @brief One of enum editorHighlightState: the state the row started in the
+   *        last time hl was worked out. Reset to HLSTATE_UNKNOWN when it
+   *        changes.
+   */
+  int hlin;
+} erow;
 
 /**
- * @brief Enable the terminal's raw mode.
+ * @brief A run of consecutive entries in E.lineoff.
  */
-void enableRawMode() {
-  // Save the terminal's original attributes, and reset them on exit (so that
-  // the user's shell doesn't break).
-  if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
-  atexit(disableRawMode);
+struct lineChunk {
+  /** @brief Number of entries in use. Never 0 once the chunk's in the index. */
+  int n;
+  uint64_t line[KILO_CHUNK_ROWS];
 
-  // Copy of the terminal's attributes to be modified.
-  struct termios raw = E.orig_termios;
+  /**
+   * @brief The enum editorHighlightState each row ends in, as of the last
+   *        time it was lexed, plus KILO_HL_DIRTY if it needs lexing again.
+   *        Kept here rather than in the erow, so that highlighting never has
+   *        to materialize a row.
+   */
+  unsigned char hl[KILO_CHUNK_ROWS];
 
-  raw.c_iflag &= ~(
-      // Keep break conditions from sending SIGINT.
-      BRKINT
-      // Ensure that carriage returns (13, '\r') aren't automatically translated
-      // into newlines (10, '\n'). This fixes Ctrl-M.
-      | ICRNL
-      // Disable parity checking.
-      | INPCK
-      // Prevent the 8th bit of every input byte from being stripped.
-      | ISTRIP
-      // Ignore XOFF (Ctrl-S) & XON (Ctrl-Q)
-      | IXON
-  );
+  /** @brief Number of entries in hl with KILO_HL_DIRTY set. */
+  int hldirty;
+};
 
-  // Ignore all output processing.
-  raw.c_oflag &= ~(OPOST);
+/**
+ * @brief The document's rows, in order, split into chunks of at most
+ *        KILO_CHUNK_ROWS entries so that a row can be inserted or deleted
+ *        without moving every row after it.
+ */
+struct lineIndex {
+  /** @brief The chunks, in order. */
+  struct lineChunk **chunks;
+  int nchunks;
 
-  // Set the character size to 8 bits per byte.
-  raw.c_cflag |= (CS8);
+  /** @brief Number of chunks that `chunks` and `start` have room for. */
+  int cap;
 
-  raw.c_lflag &= ~(
-      // Turn off echoing
-      ECHO
-      // Turn off canonical mode (read input a byte at a time)
-      | ICANON
-      // Ignore the effects of Ctrl-V
-      | IEXTEN
-      // Ignore signals like SIGINT (Ctrl-C) & SIGTSTP (Ctrl-Z / Ctrl-Y)
-      | ISIG
-  );
+  /**
+   * @brief Index of the first row of each chunk. Only worked out for chunks
+   *        before `valid`, and brought forward when it's needed, so that an
+   *        edit doesn't have to renumber every chunk after it.
+   */
+  int *start;
+  int valid;
 
-  // Force read() to return after recieving more than 0 bytes.
-  raw.c_cc[VMIN] = 0;
+  /** @brief The chunk the last lookup landed in, to try first next time. */
+  int last;
+};
 
-  // Force read() to return after 1/10th of a second (100ms)
-  raw.c_cc[VTIME] = 1;
+/**
+ * @brief Where the erows of materialized rows live. They're handed out in
+ *        blocks that never move, so a row stays where it is however many rows
+ *        are inserted or deleted around it, and rows that are never
+ *        materialized take up no room here at all.
+ */
+struct rowPool {
+  /** @brief Every block. Only this array of pointers is ever reallocated. */
+  erow **blocks;
+  int nblocks;
 
-  // Tell the terminal to use our modified attributes.
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
-}
+  /** @brief Number of slots handed out so far, including freed ones. */
+  int used;
+
+  /**
+   * @brief The last slot freed, or -1. Freed slots are chained together
+   *        through their size.
+   */
+  int free;
+};
 
 /**
- * @brief Read keypresses from stdin.
- * @return The character read.
+ * @brief How to highlight one filetype.
  */
-int editorReadKey() {
-  int nread;
-  char c;
+struct editorSyntax {
+  /** @brief Name of the filetype. */
+  char *filetype;
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
+  /**
+   * @brief NULL-terminated list of patterns to match filenames against. Ones
+   *        starting with a . are matched against the extension.
+   */
+  char **filematch;
 
-  // Handle escape sequences (i.e. <Home>, <Up>, <Right>, <Delete>...)
-  if (c == '\x1b') {
-    char seq[3];
+  /**
+   * @brief NULL-terminated list of keywords. Secondary keywords (types) end in
+   *        a |.
+   */
+  char **keywords;
 
-    // If there aren't at least two more characters after <Escape> (like you
-    // typically need in escape sequences - i.e. "<Escape>[A") then just return
-    // <Escape>.
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+  /** @brief What starts a single-line comment, or NULL. */
+  char *comment;
 
-    // Most (if not all) escape sequences need an '[' right after the <Escape>.
-    if (seq[0] == '[') {
-      // If the character after the '[' is between 0-9...
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        // If there's nothing after that, just return <Escape>.
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+  /** @brief What starts a multi-line comment, or NULL. */
+  char *mlstart;
 
-        // If there is, and it's a tilde...
-        if (seq[2] == '~') {
-          // Alias to PAGE_UP, PAGE_DOWN, HOME_KEY, END_KEY, & DEL_KEY.
-          switch (seq[1]) {
+  /** @brief What ends a multi-line comment, or NULL. */
+  char *mlend;
+
+  /** @brief Bitfield of HL_HIGHLIGHT_* flags. */
+  int flags;
+};
+
+/**
+ * @brief Appendable buffer of chars (a.k.a. a dynamic string).
+ */
+struct abuf {
+  /**
+   * @brief Pointer to the buffer in memory.
+   */
+  char *b;
+
+  /**
+   * @brief Length of the buffer.
+   */
+  int len;
+
+  /**
+   * @brief Number of chars b has room for.
+   */
+  int cap;
+};
+
+/**
+ * @brief An empty abuf (appendable buffer).
+ */
+#define ABUF_INIT { NULL, 0, 0 }
+
+/**
+ * @brief A set of byte-scanning routines, all doing the same thing with a
+ *        different instruction set (see scanKernels).
+ */
+struct scanKernel {
+  /** @brief Name of the instruction set, for display. */
+  const char *name;
+
+  /** @brief Returns whether the running CPU supports this kernel. */
+  int (*supported)(void);
+
+  /** @brief Count occurrences of the byte c in p[0, n). */
+  size_t (*count)(const char *p, size_t n, int c);
+
+  /** @brief Find the first c in p[0, n), or return NULL if there isn't one. */
+  char *(*find)(const char *p, size_t n, int c);
+};
+
+/**
+ * @brief One chunk of a file being indexed by the worker pool.
+ */
+struct indexChunk {
+  /** @brief Start of the chunk, inside E.map. */
+  char *start;
+
+  /** @brief End of the chunk. */
+  char *end;
+
+  /** @brief Offsets (from start) of every newline in the chunk, in order. */
+  uint32_t *nl;
+
+  /** @brief Number of entries in nl. */
+  size_t nnl;
+
+  /** @brief Whether a worker's finished with the chunk. Guarded by lock. */
+  int done;
+};
+
+/**
+ * @brief A pool of threads that find the line boundaries in a big mapped file
+ *        in parallel.
+ *
+ * Workers take chunks in order and fill in each one's table of newline
+ * offsets, but never touch E.lineoff. The main thread turns finished chunks
+ * into rows in order, as soon as every chunk before them is finished too; it's
+ * told about finished chunks through a pipe that the event loop watches.
+ */
+struct indexPool {
+  pthread_t threads[KILO_MAX_INDEX_THREADS];
+  int nthreads;
+
+  struct indexChunk *chunks;
+  int nchunks;
+
+  /** @brief Next chunk for a worker to take. Guarded by lock. */
+  int next;
+
+  /** @brief Number of chunks (from the start) turned into rows so far. */
+  int stitched;
+
+  /** @brief Set to tell the workers to stop early. Guarded by lock. */
+  int stop;
+
+  pthread_mutex_t lock;
+
+  /**
+   * @brief Pipe the workers write a 0 to after each chunk, or the errno they
+   *        failed with, since only the main thread may die().
+   */
+  int notify[2];
+};
+
+/**
+ * @brief A save that's being written out by a background thread.
+ *
+ * The document is snapshotted into iov on the main thread, which is cheap:
+ * runs of rows that are still backed by E.map, and ROW_ARENA rows, can't
+ * change under the thread, so they're pointed at where they are. Only rows
+ * that have been edited are copied. The thread writes iov to a temp file next
+ * to the file, fsync()s it and renames it into place, so the file on disk is
+ * always either all of the old version or all of the new one.
+ */
+struct saveJob {
+  struct iovec *iov;
+  int niov;
+  int cap;
+
+  /** @brief Copies of the ROW_HEAP rows, with their newlines. */
+  struct arena copies;
+
+  /** @brief Total length of iov, in bytes. */
+  size_t size;
+
+  /** @brief The file to save to. */
+  char *path;
+
+  /** @brief E.dirty when the snapshot was taken. */
+  int dirty;
+
+  /** @brief 0 once the thread's saved the file, or the errno it failed with. */
+  int err;
+
+  pthread_t thread;
+
+  /** @brief Pipe the thread writes to once it's done. */
+  int notify[2];
+};
+
+/**
+ * @brief A copy of what's currently on the terminal, so that redraws only have
+ *        to send the rows that changed.
+ */
+struct screenFrame {
+  /**
+   * @brief nrows buffers, holding the bytes that were sent to draw each row
+   *        (escape sequences and all).
+   */
+  struct abuf *rows;
+
+  /** @brief Number of screen rows the frame covers. */
+  int nrows;
+
+  /**
+   * @brief Whether the frame matches the terminal. If it doesn't, the next
+   *        redraw repaints every row.
+   */
+  int valid;
+
+  /** @brief Where the cursor was last left (0-indexed column). */
+  int cx;
+
+  /** @brief Where the cursor was last left (0-indexed row). */
+  int cy;
+};
+
+/**
+ * @brief A line of text being typed into the message bar.
+ */
+struct editorPromptState {
+  /** @brief Whether the prompt's up. While it is, keys go to it. */
+  int active;
+
+  /** @brief printf() format for the prompt, with a %s for what's typed. */
+  const char *fmt;
+
+  /** @brief What's been typed so far. */
+  char buf[KILO_PROMPT_MAX];
+  int len;
+
+  /**
+   * @brief Called with what's typed after every key, as well as the key. The
+   *        prompt's closed after '\r' or '\x1b' are passed.
+   */
+  void (*callback)(char *buf, int key);
+};
+
+/**
+ * @brief Where a search match is.
+ */
+struct searchMatch {
+  int row;
+
+  /** @brief Index of the match's first char in the row's text. */
+  int col;
+};
+
+/**
+ * @brief An incremental search, which runs in the background on the event loop.
+ *        Rows are scanned from the row the search started on to the end of the
+ *        file, and then from the top back round to it again, so matches are
+ *        found in the order "next match" visits them.
+ */
+struct editorSearch {
+  /** @brief Whether there's a search going on. */
+  int active;
+
+  /** @brief What's being searched for. */
+  char query[KILO_PROMPT_MAX];
+  int qlen;
+
+  /** @brief Every match found so far, in the order they were found. */
+  struct searchMatch *matches;
+  int nmatches;
+  int cap;
+
+  /** @brief The match the cursor's on, or -1. */
+  int current;
+
+  /**
+   * @brief The next of the old matches to check against a query that's been
+   *        narrowed down, or -1 if there aren't any left to check. Matches
+   *        before `kept` have been checked, and the ones from `narrow` on
+   *        haven't yet; the ones in between didn't match.
+   */
+  int narrow;
+  int kept;
+
+  /** @brief The row the search started on. */
+  int start;
+
+  /** @brief The next row to scan. */
+  int next;
+
+  /** @brief Whether the scan's wrapped back round to the top of the file. */
+  int wrapped;
+
+  /** @brief Whether every row's been scanned. */
+  int done;
+
+  /** @brief Where the cursor and screen were before the search. */
+  int savedcx, savedcy, savedrowoff, savedcoloff;
+};
+
+/**
+ * @brief The undo journal: a log of every edit made, oldest first. Rows are
+ *        never copied, so it only grows with the edits and not with the file.
+ *
+ * Each record inserts or deletes some text at a row and column, where a '\n'
+ * in the text splits or joins rows. Records are encoded into the arena as:
+ *
+ *     kind | flags    1 byte (enum undoKind, UNDO_BACKWARD and UNDO_GROUP)
+ *     row, col, len   varints
+ *     text            len bytes
+ *
+ * Edits that carry straight on from each other (typing, or holding down
+ * Backspace or Delete) are collected into one open record, which is only
+ * encoded once something else comes along.
+ */
+struct undoLog {
+  /** @brief Where the records are encoded. */
+  struct arena arena;
+
+  /** @brief Every record, oldest first. */
+  unsigned char **recs;
+  int nrecs;
+  int cap;
+
+  /**
+   * @brief Where the arena was up to just before each record was encoded,
+   *        so that records that can no longer be redone can be given back.
+   */
+  struct arenaMark *marks;
+
+  /**
+   * @brief Records before this one are undone next. The ones from it on have
+   *        been undone, and can be redone.
+   */
+  int cur;
+
+  /**
+   * @brief Whether there's an open record. The fields after this describe it,
+   *        the same way as its encoding will.
+   */
+  int open;
+  int kind;
+  int flags;
+  int row;
+  int col;
+
+  /** @brief Where the text inserted so far ends, for UNDO_INSERT records. */
+  int endrow;
+  int endcol;
+
+  /** @brief The text. UNDO_BACKWARD records collect it back to front. */
+  struct abuf text;
+
+  /** @brief When the last edit was added to the record. */
+  long long time;
+
+  /** @brief Whether the next record opened gets UNDO_GROUP. */
+  int joinnext;
+};
+
+#ifdef KILO_STATS
+/**
+ * @brief A histogram with log-linear buckets: values under 16 get a bucket
+ *        each, and every power of two above that is split into 8 buckets, so
+ *        each bucket's within 12.5% of the values in it.
+ */
+struct statsHistogram {
+  uint64_t buckets[STATS_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+};
+
+/**
+ * @brief Per-frame instrumentation, for builds with -DKILO_STATS.
+ */
+struct editorStats {
+  /** @brief One histogram for each enum editorStat. */
+  struct statsHistogram hist[STAT_COUNT];
+
+  /** @brief What's been measured since the last frame was recorded. */
+  uint64_t cur[STAT_COUNT];
+
+  /** @brief Whether any keys have been handled since the last frame. */
+  int keys;
+};
+#endif
+
+/**
+ * @brief Ring buffer of bytes that have been read from stdin, but haven't been
+ *        decoded into keys yet.
+ */
+struct inputBuffer {
+  unsigned char buf[KILO_INPUT_BUFSIZE];
+
+  /** @brief Index of the oldest byte in buf. */
+  unsigned int head;
+
+  /** @brief Number of bytes in buf. */
+  unsigned int len;
+};
+
+/**
+ * @brief A one-shot timer in the event loop.
+ */
+struct eventTimer {
+  /** @brief When to fire, in ms on the editorNow() clock. */
+  long long when;
+
+  /** @brief Called when the timer fires. */
+  void (*fn)(void);
+};
+
+/**
+ * @brief An extra file descriptor watched by the event loop.
+ */
+struct eventWatch {
+  int fd;
+
+  /** @brief Called with fd whenever fd is readable. */
+  void (*fn)(int fd);
+};
+
+/**
+ * @brief State for editorRun(), the editor's event loop.
+ *
+ * The loop sleeps in poll() until a key is pressed, a signal arrives, a
+ * watched fd is readable or a timer is due; it never wakes up otherwise. Idle
+ * tasks are for long-running work that's done in small slices between keys.
+ */
+struct eventLoop {
+  struct eventTimer timers[KILO_MAX_TIMERS];
+  int ntimers;
+
+  /**
+   * @brief Idle tasks. Each call should do a small slice of work, and return 1
+   *        if there's more to do or 0 once it's finished (which removes it).
+   */
+  int (*idle[KILO_MAX_IDLE])(void);
+  int nidle;
+
+  struct eventWatch watches[KILO_MAX_WATCHES];
+  int nwatches;
+
+  /**
+   * @brief Self-pipe that signal handlers write to, so that signals wake poll()
+   *        up without any race. [0] is the read end, [1] is the write end.
+   */
+  int sigpipe[2];
+
+  /** @brief Set by the SIGWINCH handler when the window's been resized. */
+  volatile sig_atomic_t winch;
+};
+
+/**
+ * @brief Global editor config struct.
+ */
+struct editorConfig {
+  /** @brief Cursor x position (column). */
+  int cx;
+
+  /** @brief Cursor y position (row). */
+  int cy;
+
+  /** @brief The column E.cx is drawn at, once tabs and such are expanded. */
+  int rx;
+
+  /** @brief The row of the document at the top of the screen. */
+  int rowoff;
+
+  /** @brief The column of the document at the left edge of the screen. */
+  int coloff;
+
+  /** @brief The E.rowoff that the last prefetch was done for. */
+  int prefetchoff;
+
+  /**
+   * @brief The height of the window in rows.
+   */
+  int screenrows;
+
+  /**
+   * @brief The width of the window in columns.
+   */
+  int screencols;
+
+  /** @brief Number of rows of text in this document. */
+  int numrows;
+
+  /**
+   * @brief Index of the rows in the document, in order. Each entry is either
+   *        KILO_LINE_LOADED and the row's slot in E.rowpool, for rows that are
+   *        materialized, or the offset of the row's first byte in E.map, for
+   *        mapped rows that haven't been needed yet. Rows are 8 bytes each
+   *        here until they're viewed, rather than sizeof(erow). Use
+   *        editorLine() to get at an entry, and editorRow() to get at a row.
+   */
+  struct lineIndex lineoff;
+
+  /** @brief The erows of materialized rows. */
+  struct rowPool rowpool;
+
+  /**
+   * @brief The memory-mapped file backing ROW_MAPPED rows, or NULL if the file
+   *        was read into the heap instead.
+   */
+  char *map;
+
+  /** @brief Length of E.map in bytes. */
+  size_t mapsize;
+
+  /**
+   * @brief Whether E.map was mapped by the editor, and so is unmapped again
+   *        along with the rows. Buffers given to editorOpenBuffer() aren't.
+   */
+  int mapowned;
+
+  /**
+   * @brief Where in E.map indexing rows into E.lineoff is up to, or NULL once
+   *        the whole file is indexed. Until then, E.numrows only counts the
+   *        rows that have been indexed so far.
+   */
+  char *indexpos;
+
+  /** @brief The indexing worker pool, while it's running, or NULL. */
+  struct indexPool *pool;
+
+  /** @brief Name of the open file, or NULL. */
+  char *filename;
+
+  /**
+   * @brief Whether the open file's lines end in "\r\n" rather than "\n", going
+   *        by its first line. Rows that are saved with a line ending of their
+   *        own making get this one.
+   */
+  int crlf;
+
+  /** @brief Number of changes made since the file was opened or last saved. */
+  int dirty;
+
+  /** @brief The save that's being written out, or NULL. */
+  struct saveJob *save;
+
+  /**
+   * @brief Whether another save was asked for while E.save was running. Any
+   *        number of them are done as one save, once it's finished.
+   */
+  int savepending;
+
+  /** @brief How to highlight the open file, or NULL not to. */
+  struct editorSyntax *syntax;
+
+  /**
+   * @brief Rows before this one have an up to date highlighting state in
+   *        E.lineoff (their hl may still be NULL, if they haven't been drawn).
+   */
+  int hlvalid;
+
+  /** @brief Scratch space for the render of rows lexed without being drawn. */
+  struct abuf hlbuf;
+
+  /** @brief Message shown in the message bar. */
+  char statusmsg[80];
+
+  /** @brief When E.statusmsg was set (see editorNow()). */
+  long long statusmsg_time;
+
+  /** @brief Whether there's a timer pending to clear E.statusmsg. */
+  int statustimer;
+
+  /** @brief The message bar prompt. */
+  struct editorPromptState prompt;
+
+  /** @brief The current search. */
+  struct editorSearch search;
+
+  /** @brief The undo journal. */
+  struct undoLog undo;
+
+  /** @brief Backing storage for ROW_ARENA rows. */
+  struct arena arena;
+
+  /** @brief The fastest scanKernel this CPU supports. */
+  const struct scanKernel *scan;
+
+  /** @brief What was last drawn to the terminal. */
+  struct screenFrame frame;
+
+  /**
+   * @brief Output buffer for editorRefreshScreen(). It's reset rather than
+   *        freed after each frame, so steady-state redraws don't allocate.
+   */
+  struct abuf ab;
+
+  /** @brief Scratch buffer that editorDrawRows() draws each row into. */
+  struct abuf line;
+
+  /** @brief Input that's been read but not processed yet. */
+  struct inputBuffer input;
+
+  /** @brief The event loop. */
+  struct eventLoop loop;
+
+#ifdef KILO_STATS
+  /** @brief Frame-time instrumentation. */
+  struct editorStats stats;
+#endif
+
+  /**
+   * @brief The original attributes for termios
+   */
+  struct termios orig_termios;
+};
+
+/**
+ * @brief Main instance of editorConfig.
+ */
+struct editorConfig E;
+
+/*** FILETYPES ***/
+
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", ".cc", ".hpp", NULL };
+
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+  "do", "goto", "sizeof", "const", "volatile", "extern", "inline",
+  "#include", "#define", "#ifdef", "#ifndef", "#endif", "#if", "#else",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "short|", "size_t|", "ssize_t|", NULL
+};
+
+/**
+ * @brief The highlight database: every filetype that can be highlighted.
+ */
+struct editorSyntax HLDB[] = {
+  {
+    "c",
+    C_HL_extensions,
+    C_HL_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/*** PROTOTYPES ***/
+
+long long editorNow();
+int editorAddTimer(int ms, void (*fn)(void));
+int editorAddIdle(int (*fn)(void));
+int editorWatchFd(int fd, void (*fn)(int fd));
+void editorUnwatchFd(int fd);
+void editorIndexStop();
+void editorIndexWait();
+void editorSave();
+void editorSaveWait();
+void editorSyntaxEdit(int at);
+int editorSyntaxIdle();
+int abReserve(struct abuf *ab, int n);
+void abAppend(struct abuf *ab, const char *s, int len);
+void abReset(struct abuf *ab);
+void abFree(struct abuf *ab);
+void editorUndoFree();
+void editorSetStatusMessage(const char *fmt, ...);
+void editorPromptStart(const char *fmt, void (*callback)(char *, int));
+int editorSearchIdle();
+
+/*** TERMINAL ***/
+
+/**
+ * @brief Print an error message and exit the program.
+ * @param s The error message
+ */
+void die(const char *s) {
+  // Clear the screen
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+
+  // Position the cursor at the top left
+  write(STDOUT_FILENO, "\x1b[H", 3);
+
+  perror(s);
+  exit(1);
+}
+
+/**
+ * @brief Reset the terminal's attributes so that the user's shell isn't broken.
+ */
+void disableRawMode() {
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
+    die("tcsetattr");
+  }
+}
+
+/**
+ * @brief Enable the terminal's raw mode.
+ */
+void enableRawMode() {
+  // Save the terminal's original attributes, and reset them on exit (so that
+  // the user's shell doesn't break).
+  if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
+  atexit(disableRawMode);
+
+  // Copy of the terminal's attributes to be modified.
+  struct termios raw = E.orig_termios;
+
+  raw.c_iflag &= ~(
+      // Keep break conditions from sending SIGINT.
+      BRKINT
+      // Ensure that carriage returns (13, '\r') aren't automatically translated
+      // into newlines (10, '\n'). This fixes Ctrl-M.
+      | ICRNL
+      // Disable parity checking.
+      | INPCK
+      // Prevent the 8th bit of every input byte from being stripped.
+      | ISTRIP
+      // Ignore XOFF (Ctrl-S) & XON (Ctrl-Q)
+      | IXON
+  );
+
+  // Ignore all output processing.
+  raw.c_oflag &= ~(OPOST);
+
+  // Set the character size to 8 bits per byte.
+  raw.c_cflag |= (CS8);
+
+  raw.c_lflag &= ~(
+      // Turn off echoing
+      ECHO
+      // Turn off canonical mode (read input a byte at a time)
+      | ICANON
+      // Ignore the effects of Ctrl-V
+      | IEXTEN
+      // Ignore signals like SIGINT (Ctrl-C) & SIGTSTP (Ctrl-Z / Ctrl-Y)
+      | ISIG
+  );
+
+  // Make read() return straight away, even with nothing to read. Waiting for
+  // input is left to poll() in the event loop.
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+
+  // Tell the terminal to use our modified attributes.
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+}
+
+/**
+ * @brief Read everything that's available on stdin (up to however much room
+ *        is left) into E.input, with a single readv() call. Doesn't wait if
+ *        there's nothing to read.
+ * @return Number of bytes read.
+ */
+int editorFillInput() {
+  struct inputBuffer *in = &E.input;
+  unsigned int space = KILO_INPUT_BUFSIZE - in->len;
+  if (space == 0) return 0;
+
+  // The free space starts after the newest byte, and may wrap around the end
+  // of the buffer.
+  unsigned int tail = (in->head + in->len) % KILO_INPUT_BUFSIZE;
+  unsigned int first = KILO_INPUT_BUFSIZE - tail;
+  if (first > space) first = space;
+
+  struct iovec iov[2];
+  iov[0].iov_base = &in->buf[tail];
+  iov[0].iov_len = first;
+  iov[1].iov_base = in->buf;
+  iov[1].iov_len = space - first;
+
+  STATS(E.stats.cur[STAT_READS]++);
+  ssize_t nread = readv(STDIN_FILENO, iov, 2);
+  if (nread == -1) {
+    if (errno != EAGAIN && errno != EINTR) die("read");
+    return 0;
+  }
+
+  in->len += nread;
+  return nread;
+}
+
+/**
+ * @brief Make sure at least `n` bytes are waiting in E.input, waiting for more
+ *        to arrive if need be.
+ * @param n Number of bytes needed.
+ * @param timeout Longest to wait (in ms) for each read, or -1 to wait forever.
+ * @return 1 if there are enough bytes, 0 otherwise.
+ */
+int editorInputWait(unsigned int n, int timeout) {
+  while (E.input.len < n) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout);
+
+    if (ready == -1 && errno != EINTR) die("poll");
+    if (ready <= 0) return 0;
+
+    if (editorFillInput() == 0 && (pfd.revents & (POLLHUP | POLLERR))) {
+      // The terminal's gone away.
+      errno = EIO;
+      die("read");
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * @brief Look at a byte in E.input without consuming it.
+ * @param i How far past the oldest byte to look. Must be less than
+ *          E.input.len.
+ * @return The byte.
+ */
+int editorInputPeek(unsigned int i) {
+  return E.input.buf[(E.input.head + i) % KILO_INPUT_BUFSIZE];
+}
+
+/**
+ * @brief Drop the `n` oldest bytes from E.input.
+ * @param n Number of bytes to drop. Must be at most E.input.len.
+ */
+void editorInputConsume(unsigned int n) {
+  E.input.head = (E.input.head + n) % KILO_INPUT_BUFSIZE;
+  E.input.len -= n;
+}
+
+/**
+ * @brief Check whether there's more input to process right now, without
+ *        waiting for any.
+ * @return 1 if a key can be read without blocking, 0 otherwise.
+ */
+int editorInputPending() {
+  if (E.input.len > 0) return 1;
+
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  if (poll(&pfd, 1, 0) <= 0) return 0;
+
+  return editorFillInput() > 0;
+}
+
+/**
+ * @brief Read keypresses from stdin.
+ * @return The character read.
+ */
+int editorReadKey() {
+  while (!editorInputWait(1, -1)) {
+    // Interrupted by a signal; keep waiting.
+  }
+
+  int c = editorInputPeek(0);
+  editorInputConsume(1);
+
+  // Handle escape sequences (i.e. <Home>, <Up>, <Right>, <Delete>...)
+  if (c == '\x1b') {
+    int seq[3];
+
+    // If there aren't at least two more characters after <Escape> (like you
+    // typically need in escape sequences - i.e. "<Escape>[A") then just return
+    // <Escape>.
+    if (!editorInputWait(2, KILO_ESC_TIMEOUT)) return '\x1b';
+    seq[0] = editorInputPeek(0);
+    seq[1] = editorInputPeek(1);
+
+    // Most (if not all) escape sequences need an '[' right after the <Escape>.
+    if (seq[0] == '[') {
+      // If the character after the '[' is between 0-9...
+      if (seq[1] >= '0' && seq[1] <= '9') {
+        // If there's nothing after that, just return <Escape>.
+        if (!editorInputWait(3, KILO_ESC_TIMEOUT)) return '\x1b';
+        seq[2] = editorInputPeek(2);
+        editorInputConsume(3);
+
+        // If there is, and it's a tilde...
+        if (seq[2] == '~') {
+          // Alias to PAGE_UP, PAGE_DOWN, HOME_KEY, END_KEY, & DEL_KEY.
+          switch (seq[1]) {
             case '1': return HOME_KEY;
-            case '0': return DEL_KEY;
+            case '3': return DEL_KEY;
             case '4': return END_KEY;
             case '5': return PAGE_UP;
             case '6': return PAGE_DOWN;
@@ -204,261 +1334,4091 @@ int editorReadKey() {
           }
         }
       } else {
-        // Alias arrow keys to ARROW_UP, ARROW_DOWN, ARROW_RIGHT, & ARROW_LEFT.
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
+        editorInputConsume(2);
+
+        // Alias arrow keys to ARROW_UP, ARROW_DOWN, ARROW_RIGHT, & ARROW_LEFT.
+        switch (seq[1]) {
+          case 'A': return ARROW_UP;
+          case 'B': return ARROW_DOWN;
+          case 'C': return ARROW_RIGHT;
+          case 'D': return ARROW_LEFT;
+          case 'H': return HOME_KEY;
+          case 'F': return END_KEY;
+        }
+      }
+    } else if (seq[0] == 'O') {
+      editorInputConsume(2);
+
+      // Some systems use 'O' instead of '[' in some of their escape codes.
+      switch (seq[1]) {
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+      }
+    }
+
+    // Give up and just return <Escape>.
+    return '\x1b';
+  } else {
+    return c;
+  }
+}
+
+/**
+ * @brief Get the current cursor position.
+ * @param rows Pointer to how many rows over the cursor is.
+ * @param cols Pointer to how many columns down the cursor is.
+ * @return -1 on failure, 0 on success.
+ */
+int getCursorPosition(int *rows, int *cols) {
+  char buf[32];
+  unsigned int i = 0;
+
+  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+  
+  // The reply is read through E.input, since it's waited for the same way as
+  // the rest of an escape sequence.
+  while (i < sizeof(buf) - 1) {
+    if (!editorInputWait(1, KILO_ESC_TIMEOUT)) break;
+    buf[i] = editorInputPeek(0);
+    editorInputConsume(1);
+    if (buf[i] == 'R') break;
+    i++;
+  }
+  buf[i] = '\0';
+  
+  if (buf[0] != '\x1b' || buf[1] != '[') return -1;
+  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+
+  return 0;
+}
+
+/**
+ * @brief Get current window size in rows and columns from the terminal driver.
+ *        It's just an ioctl(), so it's cheap enough to do on every resize.
+ * @param rows Pointer to the number of rows
+ * @param cols Pointer to the number of columns
+ * @return -1 if failed (rows & cols will not be set), 0 if success (rows & cols
+ *         will be set)
+ */
+int getWindowSize(int *rows, int *cols) {
+  struct winsize ws;
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    return -1;
+  }
+
+  *cols = ws.ws_col;
+  *rows = ws.ws_row;
+  return 0;
+}
+
+/**
+ * @brief Work out the window size by moving the cursor as far right and down
+ *        as it'll go, and asking the terminal where it ended up. That's a round
+ *        trip through the terminal, so it's only done once, at startup, for
+ *        terminals where getWindowSize() doesn't work.
+ * @param rows Pointer to the number of rows
+ * @param cols Pointer to the number of columns
+ * @return -1 on failure, 0 on success.
+ */
+int getWindowSizeFallback(int *rows, int *cols) {
+  if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+  return getCursorPosition(rows, cols);
+}
+
+/**
+ * @brief Set E.screenrows and E.screencols for a window size. The bottom two
+ *        rows are for the status and message bars, but there's always at
+ *        least one row of text, however small the window.
+ * @param rows Height of the window.
+ * @param cols Width of the window.
+ */
+void editorSetWindowSize(int rows, int cols) {
+  E.screenrows = rows > 3 ? rows - 2 : 1;
+  E.screencols = cols;
+}
+
+/*** ARENA ***/
+
+/**
+ * @brief Allocate `n` bytes from an arena.
+ * @param a The arena to allocate from.
+ * @param n The number of bytes needed.
+ * @return Pointer to the new bytes. Never NULL; dies if out of memory.
+ */
+char *arenaAlloc(struct arena *a, size_t n) {
+  struct arenaChunk *c = a->head;
+
+  if (c == NULL || c->cap - c->used < n) {
+    size_t cap = n > KILO_ARENA_CHUNK_SIZE ? n : KILO_ARENA_CHUNK_SIZE;
+
+    c = malloc(sizeof(struct arenaChunk) + cap);
+    if (c == NULL) die("malloc");
+
+    c->next = a->head;
+    c->used = 0;
+    c->cap = cap;
+    a->head = c;
+  }
+
+  char *p = &c->data[c->used];
+  c->used += n;
+  return p;
+}
+
+/**
+ * @brief Note how far an arena has got.
+ * @param a The arena.
+ * @return A mark to pass to arenaRewind().
+ */
+struct arenaMark arenaGetMark(struct arena *a) {
+  struct arenaMark m = { a->head, a->head != NULL ? a->head->used : 0 };
+  return m;
+}
+
+/**
+ * @brief Free everything allocated from an arena since a mark was taken.
+ * @param a The arena.
+ * @param m The mark, from arenaGetMark() on the same arena. Marks taken after
+ *        it are no good any more.
+ */
+void arenaRewind(struct arena *a, struct arenaMark m) {
+  while (a->head != m.chunk) {
+    struct arenaChunk *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+
+  if (a->head != NULL) a->head->used = m.used;
+}
+
+/**
+ * @brief Free everything that was ever allocated from an arena.
+ * @param a The arena to free. It's left empty and ready for reuse.
+ */
+void arenaFree(struct arena *a) {
+  struct arenaChunk *c = a->head;
+
+  while (c != NULL) {
+    struct arenaChunk *next = c->next;
+    free(c);
+    c = next;
+  }
+
+  a->head = NULL;
+}
+
+/*** SCANNING ***/
+
+/*
+ * Kernels for finding & counting bytes (mostly newlines) in big buffers. Each
+ * vectorized kernel compares a whole register's worth of bytes against the
+ * byte being looked for at once, then falls back to the scalar kernel for
+ * whatever's left over at the end of the buffer.
+ */
+
+int scanAlwaysSupported() {
+  return 1;
+}
+
+size_t scanCountScalar(const char *p, size_t n, int c) {
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    count += p[i] == (char) c;
+  }
+
+  return count;
+}
+
+char *scanFindScalar(const char *p, size_t n, int c) {
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  uint64_t needle = ones * (unsigned char) c;
+  size_t i = 0;
+
+  // Eight bytes at a time: x has a zero byte wherever the word matches, and
+  // (x - ones) & ~x has the top bit set in some byte exactly when x has one.
+  for (; i + 8 <= n; i += 8) {
+    uint64_t x;
+    memcpy(&x, &p[i], 8);
+    x ^= needle;
+    if ((x - ones) & ~x & highs) break;
+  }
+
+  for (; i < n; i++) {
+    if (p[i] == (char) c) return (char *) &p[i];
+  }
+
+  return NULL;
+}
+
+#if defined(__SSE2__)
+size_t scanCountSSE2(const char *p, size_t n, int c) {
+  __m128i needle = _mm_set1_epi8(c);
+  size_t count = 0;
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &p[i]);
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+  }
+
+  return count + scanCountScalar(&p[i], n - i, c);
+}
+
+char *scanFindSSE2(const char *p, size_t n, int c) {
+  __m128i needle = _mm_set1_epi8(c);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &p[i]);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask) return (char *) &p[i + __builtin_ctz(mask)];
+  }
+
+  return scanFindScalar(&p[i], n - i, c);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+int scanAVX2Supported() {
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+size_t scanCountAVX2(const char *p, size_t n, int c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t count = 0;
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &p[i]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    count += __builtin_popcount(mask);
+  }
+
+  return count + scanCountScalar(&p[i], n - i, c);
+}
+
+__attribute__((target("avx2")))
+char *scanFindAVX2(const char *p, size_t n, int c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &p[i]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    if (mask) return (char *) &p[i + __builtin_ctz(mask)];
+  }
+
+  return scanFindScalar(&p[i], n - i, c);
+}
+#endif
+
+#if defined(__aarch64__)
+size_t scanCountNEON(const char *p, size_t n, int c) {
+  uint8x16_t needle = vdupq_n_u8(c);
+  uint8x16_t one = vdupq_n_u8(1);
+  size_t count = 0;
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) &p[i]);
+    count += vaddvq_u8(vandq_u8(vceqq_u8(v, needle), one));
+  }
+
+  return count + scanCountScalar(&p[i], n - i, c);
+}
+
+char *scanFindNEON(const char *p, size_t n, int c) {
+  uint8x16_t needle = vdupq_n_u8(c);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) &p[i]);
+    uint8x16_t eq = vceqq_u8(v, needle);
+
+    // Squash each byte of the comparison down to a nibble, so that the whole
+    // thing fits in (and can be searched as) a 64-bit integer.
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+    if (mask) return (char *) &p[i + (__builtin_ctzll(mask) >> 2)];
+  }
+
+  return scanFindScalar(&p[i], n - i, c);
+}
+#endif
+
+/**
+ * @brief Every scanKernel built into this binary, best first. The scalar
+ *        kernel is always last, and always supported.
+ */
+const struct scanKernel scanKernels[] = {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  { "avx2", scanAVX2Supported, scanCountAVX2, scanFindAVX2 },
+#endif
+#if defined(__SSE2__)
+  { "sse2", scanAlwaysSupported, scanCountSSE2, scanFindSSE2 },
+#endif
+#if defined(__aarch64__)
+  { "neon", scanAlwaysSupported, scanCountNEON, scanFindNEON },
+#endif
+  { "scalar", scanAlwaysSupported, scanCountScalar, scanFindScalar }
+};
+
+/**
+ * @brief Find the first place a string appears in a buffer. Candidates for its
+ *        first byte are found with E.scan, and then the rest is checked.
+ * @param p Start of the buffer.
+ * @param n Length of the buffer.
+ * @param q The string to look for.
+ * @param qlen Length of the string. Must be at least 1.
+ * @return Pointer to the first match, or NULL if there isn't one.
+ */
+char *scanSearch(const char *p, size_t n, const char *q, size_t qlen) {
+  if (qlen > n) return NULL;
+
+  // Matches can't start any later than this.
+  const char *last = p + n - qlen;
+
+  while (p <= last) {
+    char *c = E.scan->find(p, last - p + 1, q[0]);
+    if (c == NULL) return NULL;
+    if (memcmp(c + 1, q + 1, qlen - 1) == 0) return c;
+    p = c + 1;
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Point E.scan at a particular kernel, e.g. to compare them.
+ * @param k The kernel. The CPU has to support it.
+ */
+void scanSelect(const struct scanKernel *k) {
+  E.scan = k;
+}
+
+/**
+ * @brief Point E.scan at the best kernel this CPU supports.
+ */
+void scanInit() {
+  const struct scanKernel *k = scanKernels;
+  while (!k->supported()) k++;
+  scanSelect(k);
+}
+
+/*** ROW OPERATIONS ***/
+
+/**
+ * @brief Get the erow in a slot of E.rowpool.
+ * @param slot The slot.
+ * @return The erow.
+ */
+erow *rowPoolGet(int slot) {
+  return &E.rowpool.blocks[slot / KILO_POOL_BLOCK][slot % KILO_POOL_BLOCK];
+}
+
+/**
+ * @brief Hand out a slot in E.rowpool, reusing a freed one if there is one.
+ * @return The slot.
+ */
+int rowPoolAlloc() {
+  struct rowPool *pool = &E.rowpool;
+
+  if (pool->free != -1) {
+    int slot = pool->free;
+    pool->free = rowPoolGet(slot)->size;
+    return slot;
+  }
+
+  if (pool->used == pool->nblocks * KILO_POOL_BLOCK) {
+    erow **blocks = realloc(pool->blocks, sizeof(erow *) * (pool->nblocks + 1));
+    if (blocks == NULL) die("realloc");
+    pool->blocks = blocks;
+
+    blocks[pool->nblocks] = malloc(sizeof(erow) * KILO_POOL_BLOCK);
+    if (blocks[pool->nblocks] == NULL) die("malloc");
+    pool->nblocks++;
+  }
+
+  return pool->used++;
+}
+
+/**
+ * @brief Give a slot back to E.rowpool. Whatever the erow in it owned has to
+ *        be freed first.
+ * @param slot The slot.
+ */
+void rowPoolRelease(int slot) {
+  rowPoolGet(slot)->size = E.rowpool.free;
+  E.rowpool.free = slot;
+}
+
+/**
+ * @brief Free every block of E.rowpool.
+ */
+void rowPoolFree() {
+  struct rowPool *pool = &E.rowpool;
+  int i;
+
+  for (i = 0; i < pool->nblocks; i++) free(pool->blocks[i]);
+  free(pool->blocks);
+  pool->blocks = NULL;
+  pool->nblocks = 0;
+  pool->used = 0;
+  pool->free = -1;
+}
+
+/**
+ * @brief Make sure E.lineoff's chunk directory has room for `n` more chunks.
+ *        The capacity grows geometrically.
+ * @param n Number of chunks about to be added.
+ */
+void lineIndexReserve(int n) {
+  struct lineIndex *ix = &E.lineoff;
+  if (ix->nchunks + n <= ix->cap) return;
+
+  int cap = ix->cap ? ix->cap : 16;
+  while (cap < ix->nchunks + n) cap *= 2;
+
+  struct lineChunk **chunks = realloc(ix->chunks, sizeof(*chunks) * cap);
+  if (chunks == NULL) die("realloc");
+  ix->chunks = chunks;
+
+  int *start = realloc(ix->start, sizeof(int) * cap);
+  if (start == NULL) die("realloc");
+  start[0] = 0;
+  ix->start = start;
+
+  ix->cap = cap;
+}
+
+/**
+ * @brief Allocate an empty chunk for E.lineoff.
+ * @return The chunk.
+ */
+struct lineChunk *lineChunkNew() {
+  struct lineChunk *c = malloc(sizeof(struct lineChunk));
+  if (c == NULL) die("malloc");
+  c->n = 0;
+  c->hldirty = 0;
+  return c;
+}
+
+/**
+ * @brief Work out the index of a chunk's first row, if it isn't known yet.
+ * @param k Index of the chunk.
+ * @return Index of the chunk's first row.
+ */
+int lineIndexStart(int k) {
+  struct lineIndex *ix = &E.lineoff;
+
+  while (ix->valid <= k) {
+    ix->start[ix->valid] =
+      ix->start[ix->valid - 1] + ix->chunks[ix->valid - 1]->n;
+    ix->valid++;
+  }
+
+  return ix->start[k];
+}
+
+/**
+ * @brief Find the chunk of E.lineoff that a row is in.
+ * @param at Index of the row. Must be less than E.numrows.
+ * @return Index of the chunk.
+ */
+int lineIndexFind(int at) {
+  struct lineIndex *ix = &E.lineoff;
+  int k = ix->last;
+
+  // Rows tend to be looked up in order, so try the last chunk and the one
+  // after it first.
+  if (k < ix->nchunks) {
+    int s = lineIndexStart(k);
+    if (at >= s && at < s + ix->chunks[k]->n) return k;
+    s += ix->chunks[k]->n;
+    if (k + 1 < ix->nchunks && at >= s && at < s + ix->chunks[k + 1]->n) {
+      lineIndexStart(k + 1);
+      ix->last = k + 1;
+      return k + 1;
+    }
+  }
+
+  k = ix->valid - 1;
+  while (k + 1 < ix->nchunks && at >= ix->start[k] + ix->chunks[k]->n) {
+    k = ix->valid;
+    lineIndexStart(k);
+  }
+
+  int lo = 0, hi = k;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (ix->start[mid] <= at) lo = mid;
+    else hi = mid - 1;
+  }
+
+  ix->last = lo;
+  return lo;
+}
+
+/**
+ * @brief Count the highlighting states in a run of a chunk that need lexing
+ *        again.
+ * @param c The chunk.
+ * @param off Index in the chunk of the first entry.
+ * @param n Number of entries.
+ * @return How many of them have KILO_HL_DIRTY set.
+ */
+int lineChunkDirty(struct lineChunk *c, int off, int n) {
+  int dirty = 0, i;
+  for (i = off; i < off + n; i++) dirty += (c->hl[i] & KILO_HL_DIRTY) != 0;
+  return dirty;
+}
+
+/**
+ * @brief Make room for `n` new entries in E.lineoff. Only the rest of the
+ *        chunk they go in is moved, and when that chunk's full, the part of it
+ *        after them is moved into a chunk of its own. The new rows are marked
+ *        as needing lexing. E.numrows is left for the caller to update.
+ * @param at Index the first new entry will have.
+ * @param n Number of entries.
+ */
+void lineIndexInsert(int at, int n) {
+  struct lineIndex *ix = &E.lineoff;
+  int k, off;
+
+  if (n == 0) return;
+
+  if (ix->nchunks == 0) {
+    lineIndexReserve(1);
+    ix->chunks[ix->nchunks++] = lineChunkNew();
+  }
+
+  if (at == E.numrows) {
+    k = ix->nchunks - 1;
+    off = ix->chunks[k]->n;
+  } else {
+    k = lineIndexFind(at);
+    off = at - lineIndexStart(k);
+  }
+
+  struct lineChunk *c = ix->chunks[k];
+  if (ix->valid > k + 1) ix->valid = k + 1;
+
+  if (c->n + n <= KILO_CHUNK_ROWS) {
+    memmove(&c->line[off + n], &c->line[off], sizeof(uint64_t) * (c->n - off));
+    memmove(&c->hl[off + n], &c->hl[off], c->n - off);
+    memset(&c->hl[off], KILO_HL_DIRTY, n);
+    c->hldirty += n;
+    c->n += n;
+    return;
+  }
+
+  int tail = c->n - off;
+  int fill = KILO_CHUNK_ROWS - off < n ? KILO_CHUNK_ROWS - off : n;
+  int rest = n - fill;
+  int m = (rest + KILO_CHUNK_ROWS - 1) / KILO_CHUNK_ROWS + (tail > 0);
+
+  lineIndexReserve(m);
+  memmove(
+    &ix->chunks[k + 1 + m],
+    &ix->chunks[k + 1],
+    sizeof(*ix->chunks) * (ix->nchunks - k - 1)
+  );
+  ix->nchunks += m;
+
+  if (tail > 0) {
+    struct lineChunk *t = lineChunkNew();
+    memcpy(t->line, &c->line[off], sizeof(uint64_t) * tail);
+    memcpy(t->hl, &c->hl[off], tail);
+    t->n = tail;
+    t->hldirty = lineChunkDirty(c, off, tail);
+    c->hldirty -= t->hldirty;
+    ix->chunks[k + m] = t;
+  }
+  memset(&c->hl[off], KILO_HL_DIRTY, fill);
+  c->hldirty += fill;
+  c->n = off + fill;
+
+  while (rest > 0) {
+    struct lineChunk *d = lineChunkNew();
+    d->n = rest < KILO_CHUNK_ROWS ? rest : KILO_CHUNK_ROWS;
+    memset(d->hl, KILO_HL_DIRTY, d->n);
+    d->hldirty = d->n;
+    rest -= d->n;
+    ix->chunks[++k] = d;
+  }
+}
+
+/**
+ * @brief Remove `n` entries from E.lineoff. Chunks left empty are dropped, and
+ *        the ones either side of the gap are merged where they fit in one, so
+ *        deleting rows doesn't leave lots of near-empty chunks behind.
+ *        E.numrows is left for the caller to update.
+ * @param at Index of the first entry.
+ * @param n Number of entries.
+ */
+void lineIndexDelete(int at, int n) {
+  struct lineIndex *ix = &E.lineoff;
+
+  if (n == 0) return;
+
+  int k = lineIndexFind(at);
+  int off = at - lineIndexStart(k);
+  int lo = k > 0 ? k - 1 : 0;
+
+  while (n > 0) {
+    struct lineChunk *c = ix->chunks[k++];
+    int take = c->n - off < n ? c->n - off : n;
+    memmove(
+      &c->line[off],
+      &c->line[off + take],
+      sizeof(uint64_t) * (c->n - off - take)
+    );
+    c->hldirty -= lineChunkDirty(c, off, take);
+    memmove(&c->hl[off], &c->hl[off + take], c->n - off - take);
+    c->n -= take;
+    n -= take;
+    off = 0;
+  }
+
+  int hi = k < ix->nchunks ? k + 1 : ix->nchunks;
+  int w = lo, j;
+
+  for (j = lo; j < hi; j++) {
+    struct lineChunk *c = ix->chunks[j];
+    struct lineChunk *prev = w > lo ? ix->chunks[w - 1] : NULL;
+
+    if (prev != NULL && prev->n + c->n <= KILO_CHUNK_ROWS) {
+      memcpy(&prev->line[prev->n], c->line, sizeof(uint64_t) * c->n);
+      memcpy(&prev->hl[prev->n], c->hl, c->n);
+      prev->n += c->n;
+      prev->hldirty += c->hldirty;
+      free(c);
+    } else if (c->n == 0) {
+      free(c);
+    } else {
+      ix->chunks[w++] = c;
+    }
+  }
+
+  memmove(
+    &ix->chunks[w],
+    &ix->chunks[hi],
+    sizeof(*ix->chunks) * (ix->nchunks - hi)
+  );
+  ix->nchunks -= hi - w;
+
+  if (ix->valid > lo + 1) ix->valid = lo + 1;
+  if (ix->valid > ix->nchunks && ix->nchunks > 0) ix->valid = ix->nchunks;
+  ix->last = lo;
+}
+
+/**
+ * @brief Free every chunk of E.lineoff.
+ */
+void lineIndexFree() {
+  struct lineIndex *ix = &E.lineoff;
+  int k;
+
+  for (k = 0; k < ix->nchunks; k++) free(ix->chunks[k]);
+  free(ix->chunks);
+  free(ix->start);
+  ix->chunks = NULL;
+  ix->start = NULL;
+  ix->nchunks = 0;
+  ix->cap = 0;
+  ix->valid = 1;
+  ix->last = 0;
+}
+
+/**
+ * @brief Get a row's entry in E.lineoff.
+ * @param at Index of the row.
+ * @return The entry.
+ */
+uint64_t *editorLine(int at) {
+  int k = lineIndexFind(at);
+  return &E.lineoff.chunks[k]->line[at - E.lineoff.start[k]];
+}
+
+/**
+ * @brief Get the highlighting state a row ended in the last time it was
+ *        lexed. Only right for rows before E.hlvalid.
+ * @param at Index of the row, or -1 for the state the first row starts in.
+ * @return One of enum editorHighlightState.
+ */
+int editorLineState(int at) {
+  if (at < 0) return HLSTATE_NORMAL;
+
+  int k = lineIndexFind(at);
+  return E.lineoff.chunks[k]->hl[at - E.lineoff.start[k]] & ~KILO_HL_DIRTY;
+}
+
+/**
+ * @brief Insert `n` rows into the document in one go.
+ * @param at Index the first of the new rows will have.
+ * @param n Number of rows to insert.
+ * @return `at`. The new rows' entries in E.lineoff are uninitialized, and it's
+ *         up to the caller to fill them in.
+ */
+int editorInsertRows(int at, int n) {
+  lineIndexInsert(at, n);
+  E.numrows += n;
+
+  // The new rows need lexing, and so does the one after them, since it now
+  // comes after a different row. They need searching, too.
+  editorSyntaxEdit(at + n);
+  editorSyntaxEdit(at);
+  if (E.search.active && !E.search.done) editorAddIdle(editorSearchIdle);
+
+  return at;
+}
+
+/**
+ * @brief Append `n` rows to the end of the document in one go.
+ * @param n Number of rows to append.
+ * @return Index of the first of the new rows. Their entries in E.lineoff are
+ *         uninitialized, and it's up to the caller to fill them in.
+ */
+int editorAppendRows(int n) {
+  return editorInsertRows(E.numrows, n);
+}
+
+/**
+ * @brief Materialize a row: give it an erow in E.rowpool, and fill it in.
+ * @param line The row's entry in E.lineoff.
+ * @param s The row's text.
+ * @param len Length of the row's text.
+ * @param storage ROW_MAPPED to point the row straight at `s` (which must then
+ *                be inside E.map), ROW_ARENA to copy `s` into E.arena, or
+ *                ROW_HEAP to copy it into a heap buffer of the row's own.
+ * @return The row.
+ */
+erow *editorSetRow(uint64_t *line, const char *s, size_t len, int storage) {
+  int slot = rowPoolAlloc();
+  erow *row = rowPoolGet(slot);
+
+  *line = KILO_LINE_LOADED | slot;
+
+  row->size = len;
+  row->gap = len;
+  row->gaplen = 0;
+  row->storage = storage;
+  row->render = NULL;
+  row->rx = NULL;
+  row->hl = NULL;
+  row->hlin = HLSTATE_UNKNOWN;
+
+  if (storage == ROW_MAPPED) {
+    row->chars = (char *) s;
+    return row;
+  }
+
+  if (storage == ROW_ARENA) {
+    row->chars = arenaAlloc(&E.arena, len + 1);
+  } else {
+    row->chars = malloc(len + 1);
+    if (row->chars == NULL) die("malloc");
+  }
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  return row;
+}
+
+/**
+ * @brief Append a mapped row to the document without materializing it.
+ * @param s Start of the row's text, inside E.map.
+ */
+void editorAppendMapped(char *s) {
+  *editorLine(editorAppendRows(1)) = s - E.map;
+}
+
+/**
+ * @brief Find the length of a mapped row's text: up to the newline or the end
+ *        of E.map, less any carriage returns before it.
+ * @param p Start of the row's text, inside E.map.
+ * @return The length.
+ */
+size_t editorMappedLen(const char *p) {
+  const char *end = E.map + E.mapsize;
+  const char *eol = E.scan->find(p, end - p, '\n');
+
+  if (eol == NULL) eol = end;
+  while (eol > p && eol[-1] == '\r') eol--;
+  return eol - p;
+}
+
+/**
+ * @brief Get a row, materializing it first if it's a mapped row that hasn't
+ *        been needed before.
+ * @param at Index of the row.
+ * @return The row.
+ */
+erow *editorRow(int at) {
+  uint64_t *line = editorLine(at);
+
+  if (*line & KILO_LINE_LOADED) return rowPoolGet(*line & ~KILO_LINE_LOADED);
+
+  char *p = &E.map[*line];
+  return editorSetRow(line, p, editorMappedLen(p), ROW_MAPPED);
+}
+
+/**
+ * @brief Append a row to the document. Its chars are copied into E.arena,
+ *        right after the previously appended row's.
+ * @param s String to be appended
+ * @param len Length in of the string to be appended.
+ */
+void editorAppendRow(char *s, size_t len) {
+  editorSetRow(editorLine(editorAppendRows(1)), s, len, ROW_ARENA);
+}
+
+/**
+ * @brief Append every complete (i.e. newline-terminated) line in a buffer to
+ *        the document. The newlines are counted first so that E.lineoff only
+ *        has to grow once, and then found again with E.scan. Carriage returns
+ *        before the newline are stripped.
+ * @param p Start of the buffer.
+ * @param end End of the buffer.
+ * @param storage How to store the rows' text; see editorSetRow(). ROW_MAPPED
+ *                rows are only added to E.lineoff, and materialized later by
+ *                editorRow().
+ * @return The start of the incomplete line at the end of the buffer, or `end`
+ *         if the buffer ended in a newline.
+ */
+char *editorAppendLines(char *p, char *end, int storage) {
+  size_t n = E.scan->count(p, end - p, '\n');
+  if (n == 0) return p;
+
+  int at = editorAppendRows(n);
+
+  while (n--) {
+    char *nl = E.scan->find(p, end - p, '\n');
+
+    if (storage == ROW_MAPPED) {
+      *editorLine(at++) = p - E.map;
+    } else {
+      char *eol = nl;
+      while (eol > p && eol[-1] == '\r') eol--;
+      editorSetRow(editorLine(at++), p, eol - p, storage);
+    }
+
+    p = nl + 1;
+  }
+
+  return p;
+}
+
+/**
+ * @brief Throw away a row's cached render and highlighting, because it's about
+ *        to change (or be freed). Whoever changes the row's text also has to
+ *        tell editorSyntaxEdit().
+ * @param row The row.
+ */
+void editorRowInvalidate(erow *row) {
+  if (row->render != row->chars) free(row->render);
+  free(row->rx);
+  free(row->hl);
+  row->render = NULL;
+  row->rx = NULL;
+  row->hl = NULL;
+  row->hlin = HLSTATE_UNKNOWN;
+}
+
+/**
+ * @brief Work out how wide a row's text is once it's drawn. The text is given
+ *        as two runs, the ones either side of a row's gap.
+ * @param run The two runs.
+ * @param runlen Their lengths.
+ * @param plain Set to whether every char takes up exactly one column.
+ * @return The number of columns.
+ */
+int editorRenderWidth(const char *run[2], const int runlen[2], int *plain) {
+  int cols = 0;
+  int r, i;
+
+  *plain = 1;
+
+  for (r = 0; r < 2; r++) {
+    for (i = 0; i < runlen[r]; i++) {
+      unsigned char c = run[r][i];
+
+      if (c == '\t') {
+        cols += KILO_TAB_STOP - cols % KILO_TAB_STOP;
+        *plain = 0;
+      } else if (c < ' ' || c == 127) {
+        cols += 2;
+        *plain = 0;
+      } else {
+        cols++;
+      }
+    }
+  }
+
+  return cols;
+}
+
+/**
+ * @brief Draw a row's text the way it's shown: tabs are expanded to spaces,
+ *        and control chars are shown as ^X.
+ * @param run The two runs either side of the row's gap.
+ * @param runlen Their lengths.
+ * @param out Where to put the render; editorRenderWidth() + 1 bytes. It's
+ *            NUL-terminated.
+ * @param rx Where to put the column each char starts at, plus one for the end
+ *           of the row, or NULL not to.
+ */
+void editorRenderFill(
+  const char *run[2],
+  const int runlen[2],
+  char *out,
+  int *rx
+) {
+  char *render = out;
+  int cx = 0;
+  int r, i;
+
+  for (r = 0; r < 2; r++) {
+    for (i = 0; i < runlen[r]; i++) {
+      unsigned char c = run[r][i];
+      int col = out - render;
+
+      if (rx != NULL) rx[cx++] = col;
+
+      if (c == '\t') {
+        int n = KILO_TAB_STOP - col % KILO_TAB_STOP;
+        memset(out, ' ', n);
+        out += n;
+      } else if (c < ' ' || c == 127) {
+        *out++ = '^';
+        *out++ = c ^ 0x40;
+      } else {
+        *out++ = c;
+      }
+    }
+  }
+
+  if (rx != NULL) rx[cx] = out - render;
+  *out = '\0';
+}
+
+/**
+ * @brief Get a row's render, building it first if it isn't cached.
+ * @param row The row.
+ * @return row->render. row->rsize and row->rx are valid too afterwards.
+ */
+char *editorRowRender(erow *row) {
+  if (row->render != NULL) return row->render;
+
+  // The row's text is the two runs on either side of the gap.
+  const char *run[2] = { row->chars, &row->chars[row->gap + row->gaplen] };
+  int runlen[2] = { row->gap, row->size - row->gap };
+  int plain;
+  int cols = editorRenderWidth(run, runlen, &plain);
+
+  row->rsize = cols;
+
+  if (plain && runlen[1] == 0) {
+    row->render = row->chars;
+    return row->render;
+  }
+
+  row->render = malloc(cols + 1);
+  if (row->render == NULL) die("malloc");
+
+  if (plain) {
+    memcpy(row->render, run[0], runlen[0]);
+    memcpy(&row->render[runlen[0]], run[1], runlen[1]);
+    row->render[cols] = '\0';
+    return row->render;
+  }
+
+  row->rx = malloc(sizeof(int) * (row->size + 1));
+  if (row->rx == NULL) die("malloc");
+
+  editorRenderFill(run, runlen, row->render, row->rx);
+  return row->render;
+}
+
+/**
+ * @brief Convert a position in a row's chars to the column it's drawn at.
+ * @param row The row.
+ * @param cx Index into the row's text, between 0 and row->size.
+ * @return The column in the row's render.
+ */
+int editorRowCxToRx(erow *row, int cx) {
+  editorRowRender(row);
+  return row->rx != NULL ? row->rx[cx] : cx;
+}
+
+/**
+ * @brief Give a row its own heap copy of its chars, so that it can be modified.
+ *        Rows that already own their chars are left alone.
+ * @param row The row about to be modified.
+ */
+void editorRowMakeWritable(erow *row) {
+  if (row->storage == ROW_HEAP) return;
+
+  editorRowInvalidate(row);
+
+  char *chars = malloc(row->size + 1);
+  if (chars == NULL) die("malloc");
+
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->storage = ROW_HEAP;
+}
+
+/**
+ * @brief Move a row's gap so that it starts at `at`.
+ * @param row The row. Unless it's a ROW_HEAP row, `at` must be row->size (the
+ *            chars of read-only rows can't be moved around).
+ * @param at Where in the row's text the gap should start.
+ */
+void editorRowMoveGap(erow *row, int at) {
+  // A render that's a copy doesn't care where the gap is, but one that points
+  // straight at chars does.
+  if (at != row->gap && row->render == row->chars) editorRowInvalidate(row);
+
+  if (at < row->gap) {
+    memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+  } else if (at > row->gap) {
+    memmove(
+      &row->chars[row->gap],
+      &row->chars[row->gap + row->gaplen],
+      at - row->gap
+    );
+  }
+
+  row->gap = at;
+}
+
+/**
+ * @brief Make sure a row's gap can hold at least `n` more chars. The row is
+ *        made writable first if need be. A gap that has to grow at least
+ *        doubles the row's buffer, so inserts are amortized O(1).
+ * @param row The row.
+ * @param n Number of chars about to be inserted at the gap.
+ */
+void editorRowReserve(erow *row, int n) {
+  editorRowMakeWritable(row);
+  if (row->gaplen >= n) return;
+
+  int tail = row->size - row->gap;
+  int want = row->size + n;
+  int cap = (row->size + row->gaplen) * 2;
+  if (cap < want + KILO_GAP_MIN) cap = want + KILO_GAP_MIN;
+
+  editorRowInvalidate(row);
+  char *chars = realloc(row->chars, cap + 1);
+  if (chars == NULL) die("realloc");
+
+  // Slide the text after the gap up to the end of the bigger buffer.
+  memmove(&chars[cap - tail], &chars[row->gap + row->gaplen], tail);
+  chars[cap] = '\0';
+
+  row->chars = chars;
+  row->gaplen = cap - row->size;
+}
+
+/**
+ * @brief Insert a char into a row.
+ * @param row The row.
+ * @param at Where to insert the char. Clamped to the end of the row.
+ * @param c The char to insert.
+ */
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+
+  editorRowInvalidate(row);
+  editorRowReserve(row, 1);
+  editorRowMoveGap(row, at);
+
+  row->chars[row->gap++] = c;
+  row->gaplen--;
+  row->size++;
+  E.dirty++;
+}
+
+/**
+ * @brief Insert a string into a row.
+ * @param row The row.
+ * @param at Where to insert the string. Clamped to the end of the row.
+ * @param s The string to insert.
+ * @param len Length of the string.
+ */
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+
+  editorRowInvalidate(row);
+  editorRowReserve(row, len);
+  editorRowMoveGap(row, at);
+
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->gaplen -= len;
+  row->size += len;
+  E.dirty++;
+}
+
+/**
+ * @brief Append a string to the end of a row.
+ * @param row The row.
+ * @param s The string to append.
+ * @param len Length of the string.
+ */
+void editorRowAppendString(erow *row, const char *s, size_t len) {
+  editorRowInvalidate(row);
+  editorRowReserve(row, len);
+  editorRowMoveGap(row, row->size);
+
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->gaplen -= len;
+  row->size += len;
+  E.dirty++;
+}
+
+/**
+ * @brief Cut a row off at `at`, dropping everything after it. Read-only rows
+ *        don't need to be copied for this.
+ * @param row The row.
+ * @param at The row's new size.
+ */
+void editorRowTruncate(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+
+  editorRowInvalidate(row);
+
+  if (row->storage == ROW_HEAP) {
+    editorRowMoveGap(row, at);
+    row->gaplen += row->size - at;
+  } else {
+    row->gap = at;
+  }
+
+  row->size = at;
+  E.dirty++;
+}
+
+/**
+ * @brief Delete a char from a row.
+ * @param row The row.
+ * @param at Index of the char to delete.
+ */
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+
+  editorRowInvalidate(row);
+  editorRowMakeWritable(row);
+
+  if (at == row->gap - 1) {
+    // Deleting the char just before the gap (i.e. backspacing): just widen the
+    // gap backwards.
+    row->gap--;
+  } else {
+    editorRowMoveGap(row, at);
+  }
+
+  row->gaplen++;
+  row->size--;
+  E.dirty++;
+}
+
+/**
+ * @brief Get one of a row's chars, wherever the gap is.
+ * @param row The row.
+ * @param at Index of the char in the row's text.
+ * @return The char.
+ */
+int editorRowCharAt(erow *row, int at) {
+  return at < row->gap ? row->chars[at] : row->chars[at + row->gaplen];
+}
+
+/**
+ * @brief Close a row's gap by moving it to the end, so that the row's text is
+ *        contiguous in chars[0, size).
+ * @param row The row.
+ * @return The row's chars.
+ */
+char *editorRowText(erow *row) {
+  editorRowMoveGap(row, row->size);
+  return row->chars;
+}
+
+/**
+ * @brief Get a row's text without materializing it, for reading rows that
+ *        aren't on screen.
+ * @param at Index of the row.
+ * @param len Set to the length of the row's text.
+ * @return The row's text: its chars if it's materialized, or where it is in
+ *         E.map if not. It isn't NUL-terminated.
+ */
+char *editorLineText(int at, int *len) {
+  uint64_t line = *editorLine(at);
+
+  if (line & KILO_LINE_LOADED) {
+    erow *row = rowPoolGet(line & ~KILO_LINE_LOADED);
+    *len = row->size;
+    return editorRowText(row);
+  }
+
+  *len = editorMappedLen(&E.map[line]);
+  return &E.map[line];
+}
+
+/**
+ * @brief Insert a new row into the document.
+ * @param at Index the new row will have. Rows from there on are shifted down.
+ * @param s The new row's text.
+ * @param len Length of the new row's text.
+ */
+void editorInsertRow(int at, const char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+
+  editorInsertRows(at, 1);
+  editorSetRow(editorLine(at), s, len, ROW_HEAP);
+  E.dirty++;
+}
+
+/**
+ * @brief Remove a run of rows from the document in one go.
+ * @param at Index of the first row to remove.
+ * @param n Number of rows to remove.
+ */
+void editorDelRows(int at, int n) {
+  int i;
+
+  if (at < 0 || n <= 0 || at + n > E.numrows) return;
+
+  // Saving relies on unloaded rows only ever being followed by the next line
+  // of the file (or a loaded row), which the row before these wouldn't be.
+  if (at > 0) editorRow(at - 1);
+
+  for (i = at; i < at + n; i++) {
+    uint64_t line = *editorLine(i);
+    if (line & KILO_LINE_LOADED) {
+      erow *row = rowPoolGet(line & ~KILO_LINE_LOADED);
+      editorRowInvalidate(row);
+      if (row->storage == ROW_HEAP) free(row->chars);
+      rowPoolRelease(line & ~KILO_LINE_LOADED);
+    }
+  }
+
+  lineIndexDelete(at, n);
+  E.numrows -= n;
+
+  editorSyntaxEdit(at);
+  E.dirty++;
+}
+
+/**
+ * @brief Remove a row from the document.
+ * @param at Index of the row to remove.
+ */
+void editorDelRow(int at) {
+  editorDelRows(at, 1);
+}
+
+/**
+ * @brief Split a row in two.
+ * @param at Index of the row. E.numrows just appends an empty row.
+ * @param col Where to split the row. Everything from there on is moved into a
+ *            new row after it.
+ */
+void editorSplitRow(int at, int col) {
+  if (col == 0) {
+    editorInsertRow(at, "", 0);
+    return;
+  }
+
+  erow *row = editorRow(at);
+  const char *tail = &row->chars[col];
+
+  // The text after the split is already contiguous in read-only rows. In heap
+  // rows, move the gap out of its way first.
+  if (row->storage == ROW_HEAP) {
+    editorRowMoveGap(row, col);
+    tail = &row->chars[row->gap + row->gaplen];
+  }
+
+  editorInsertRow(at + 1, tail, row->size - col);
+  editorRowTruncate(row, col);
+  editorSyntaxEdit(at);
+}
+
+/**
+ * @brief Join a row onto the end of the one before it.
+ * @param at Index of the row before.
+ */
+void editorJoinRows(int at) {
+  erow *row = editorRow(at + 1);
+  erow *prev = editorRow(at);
+
+  editorRowAppendString(prev, editorRowText(row), row->size);
+  editorSyntaxEdit(at);
+  editorDelRow(at + 1);
+}
+
+/**
+ * @brief Free every row, along with the arena and file mapping backing them,
+ *        leaving the editor with an empty document.
+ */
+void editorFreeRows() {
+  int i;
+
+  editorSaveWait();
+  editorIndexStop();
+  editorUndoFree();
+
+  for (i = 0; i < E.numrows; i++) {
+    uint64_t line = *editorLine(i);
+    if (line & KILO_LINE_LOADED) {
+      erow *row = rowPoolGet(line & ~KILO_LINE_LOADED);
+      editorRowInvalidate(row);
+      if (row->storage == ROW_HEAP) free(row->chars);
+    }
+  }
+
+  lineIndexFree();
+  rowPoolFree();
+  E.numrows = 0;
+
+  arenaFree(&E.arena);
+
+  if (E.map != NULL) {
+    if (E.mapowned) munmap(E.map, E.mapsize);
+    E.map = NULL;
+    E.mapsize = 0;
+    E.indexpos = NULL;
+  }
+
+  E.prefetchoff = -1;
+  E.hlvalid = 0;
+}
+
+/*** SYNTAX HIGHLIGHTING ***/
+
+/**
+ * @brief Check if a char separates words, for the purposes of highlighting.
+ * @param c The char.
+ * @return Non-zero if it's a separator.
+ */
+int isSeparator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/**
+ * @brief Check if a string appears at a given place in a render.
+ * @param p The render.
+ * @param n Length of the render.
+ * @param at Where in the render to look.
+ * @param s The string.
+ * @param len Length of the string.
+ * @return Non-zero if it's there (and non-empty).
+ */
+int editorSyntaxMatch(const char *p, int n, int at, const char *s, int len) {
+  return len > 0 && at + len <= n && memcmp(&p[at], s, len) == 0;
+}
+
+/**
+ * @brief Highlight one row's render with E.syntax.
+ * @param p The render.
+ * @param n Length of the render.
+ * @param state The state the previous row ended in.
+ * @param hl Where to put the highlighting; n bytes.
+ * @return The state the row ends in.
+ */
+int editorSyntaxLex(const char *p, int n, int state, unsigned char *hl) {
+  struct editorSyntax *syntax = E.syntax;
+  char **keywords = syntax->keywords;
+
+  int scslen = syntax->comment ? strlen(syntax->comment) : 0;
+  int mcslen = syntax->mlstart ? strlen(syntax->mlstart) : 0;
+  int mcelen = syntax->mlend ? strlen(syntax->mlend) : 0;
+
+  int prevsep = 1;
+  int instring = 0;
+  int incomment = state == HLSTATE_MLCOMMENT;
+  int i = 0;
+
+  memset(hl, HL_NORMAL, n);
+
+  while (i < n) {
+    char c = p[i];
+    unsigned char prevhl = i > 0 ? hl[i - 1] : HL_NORMAL;
+
+    if (!instring && !incomment) {
+      if (editorSyntaxMatch(p, n, i, syntax->comment, scslen)) {
+        memset(&hl[i], HL_COMMENT, n - i);
+        break;
+      }
+    }
+
+    if (mcslen && mcelen && !instring) {
+      if (incomment) {
+        hl[i] = HL_MLCOMMENT;
+        if (editorSyntaxMatch(p, n, i, syntax->mlend, mcelen)) {
+          memset(&hl[i], HL_MLCOMMENT, mcelen);
+          i += mcelen;
+          incomment = 0;
+          prevsep = 1;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (editorSyntaxMatch(p, n, i, syntax->mlstart, mcslen)) {
+        memset(&hl[i], HL_MLCOMMENT, mcslen);
+        i += mcslen;
+        incomment = 1;
+        continue;
+      }
+    }
+
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (instring) {
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < n) {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == instring) instring = 0;
+        i++;
+        prevsep = 1;
+        continue;
+      } else if (c == '"' || c == '\'') {
+        instring = c;
+        hl[i++] = HL_STRING;
+        continue;
+      }
+    }
+
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (
+        (isdigit(c) && (prevsep || prevhl == HL_NUMBER)) ||
+        (c == '.' && prevhl == HL_NUMBER)
+      ) {
+        hl[i++] = HL_NUMBER;
+        prevsep = 0;
+        continue;
+      }
+    }
+
+    if (prevsep) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) klen--;
+
+        if (
+          editorSyntaxMatch(p, n, i, keywords[j], klen) &&
+          (i + klen == n || isSeparator(p[i + klen]))
+        ) {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+
+      if (keywords[j] != NULL) {
+        prevsep = 0;
+        continue;
+      }
+    }
+
+    prevsep = isSeparator(c);
+    i++;
+  }
+
+  return incomment ? HLSTATE_MLCOMMENT : HLSTATE_NORMAL;
+}
+
+/**
+ * @brief Work out just the state a row's render ends in, the way
+ *        editorSyntaxLex() would, but without highlighting it. Only comments
+ *        and strings can change the state, so keywords and numbers aren't
+ *        looked for at all.
+ * @param p The render.
+ * @param n Length of the render.
+ * @param state The state the previous row ended in.
+ * @return The state the row ends in.
+ */
+int editorSyntaxLexState(const char *p, int n, int state) {
+  struct editorSyntax *syntax = E.syntax;
+
+  int scslen = syntax->comment ? strlen(syntax->comment) : 0;
+  int mcslen = syntax->mlstart ? strlen(syntax->mlstart) : 0;
+  int mcelen = syntax->mlend ? strlen(syntax->mlend) : 0;
+
+  int instring = 0;
+  int incomment = state == HLSTATE_MLCOMMENT;
+  int i = 0;
+
+  while (i < n) {
+    char c = p[i];
+
+    if (!instring && !incomment) {
+      if (editorSyntaxMatch(p, n, i, syntax->comment, scslen)) break;
+    }
+
+    if (mcslen && mcelen && !instring) {
+      if (incomment) {
+        if (editorSyntaxMatch(p, n, i, syntax->mlend, mcelen)) {
+          i += mcelen;
+          incomment = 0;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (editorSyntaxMatch(p, n, i, syntax->mlstart, mcslen)) {
+        i += mcslen;
+        incomment = 1;
+        continue;
+      }
+    }
+
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (instring) {
+        if (c == '\\' && i + 1 < n) {
+          i += 2;
+          continue;
+        }
+        if (c == instring) instring = 0;
+        i++;
+        continue;
+      } else if (c == '"' || c == '\'') {
+        instring = c;
+        i++;
+        continue;
+      }
+    }
+
+    i++;
+  }
+
+  return incomment ? HLSTATE_MLCOMMENT : HLSTATE_NORMAL;
+}
+
+/**
+ * @brief Mark a row as needing lexing again, and the rows after it as maybe
+ *        needing their highlighting state updating.
+ * @param at Index of the row. E.numrows just moves E.hlvalid back.
+ */
+void editorSyntaxEdit(int at) {
+  if (at < E.numrows) {
+    int k = lineIndexFind(at);
+    struct lineChunk *c = E.lineoff.chunks[k];
+    unsigned char *hl = &c->hl[at - E.lineoff.start[k]];
+
+    if (!(*hl & KILO_HL_DIRTY)) {
+      *hl |= KILO_HL_DIRTY;
+      c->hldirty++;
+    }
+  }
+
+  if (at < E.hlvalid) E.hlvalid = at;
+  if (E.syntax != NULL) editorAddIdle(editorSyntaxIdle);
+}
+
+/**
+ * @brief Find the next row that needs lexing again.
+ * @param at Index of the first row to look at.
+ * @return Index of the row, or E.numrows if there isn't one.
+ */
+int editorSyntaxNextDirty(int at) {
+  struct lineIndex *ix = &E.lineoff;
+  if (at >= E.numrows) return E.numrows;
+
+  int k = lineIndexFind(at);
+  int off = at - lineIndexStart(k);
+
+  // Whole chunks with nothing to lex are skipped without looking at them.
+  for (; k < ix->nchunks; k++, off = 0) {
+    struct lineChunk *c = ix->chunks[k];
+    if (c->hldirty == 0) continue;
+
+    while (!(c->hl[off] & KILO_HL_DIRTY)) off++;
+    return lineIndexStart(k) + off;
+  }
+
+  return E.numrows;
+}
+
+/**
+ * @brief Find the state a row ends in. Its render is taken from the erow if
+ *        it's cached, and drawn into E.hlbuf if not, so rows that aren't on
+ *        screen are never materialized or given a render.
+ * @param at Index of the row.
+ * @param in The state the row starts in.
+ * @return The state the row ends in.
+ */
+int editorSyntaxLexLine(int at, int in) {
+  uint64_t line = *editorLine(at);
+  const char *run[2];
+  int runlen[2];
+
+  if (line & KILO_LINE_LOADED) {
+    erow *row = rowPoolGet(line & ~KILO_LINE_LOADED);
+
+    if (row->render != NULL) {
+      return editorSyntaxLexState(row->render, row->rsize, in);
+    }
+
+    run[0] = row->chars;
+    runlen[0] = row->gap;
+    run[1] = &row->chars[row->gap + row->gaplen];
+    runlen[1] = row->size - row->gap;
+  } else {
+    run[0] = &E.map[line];
+    runlen[0] = editorMappedLen(run[0]);
+    run[1] = NULL;
+    runlen[1] = 0;
+  }
+
+  // Text that's drawn just as it is can be lexed where it is.
+  int plain;
+  int cols = editorRenderWidth(run, runlen, &plain);
+  if (plain && runlen[1] == 0) return editorSyntaxLexState(run[0], cols, in);
+
+  if (abReserve(&E.hlbuf, cols + 1) == -1) die("realloc");
+  editorRenderFill(run, runlen, E.hlbuf.b, NULL);
+  return editorSyntaxLexState(E.hlbuf.b, cols, in);
+}
+
+/**
+ * @brief Bring the highlighting state of the first `n` rows up to date, from
+ *        E.hlvalid on. Only rows marked KILO_HL_DIRTY are lexed, and a row
+ *        that comes out ending in a different state marks the one after it,
+ *        so re-highlighting stops as soon as the states after an edit settle
+ *        back down, and E.hlvalid skips straight to the next dirty row.
+ * @param n Number of rows needed.
+ */
+void editorSyntaxUpdate(int n) {
+  if (n > E.numrows) n = E.numrows;
+
+  while (E.hlvalid < n) {
+    int at = E.hlvalid;
+    int k = lineIndexFind(at);
+    struct lineChunk *c = E.lineoff.chunks[k];
+    unsigned char *hl = &c->hl[at - E.lineoff.start[k]];
+
+    if (!(*hl & KILO_HL_DIRTY)) {
+      E.hlvalid = editorSyntaxNextDirty(at);
+      continue;
+    }
+
+    int old = *hl & ~KILO_HL_DIRTY;
+    int state = editorSyntaxLexLine(at, editorLineState(at - 1));
+
+    *hl = state;
+    c->hldirty--;
+    E.hlvalid++;
+
+    if (state != old && at + 1 < E.numrows) editorSyntaxEdit(at + 1);
+  }
+}
+
+/**
+ * @brief Get the highlighting for a row, bringing it up to date first.
+ * @param at Index of the row.
+ * @return The row's hl.
+ */
+unsigned char *editorRowHighlight(int at) {
+  erow *row = editorRow(at);
+  editorRowRender(row);
+
+  editorSyntaxUpdate(at + 1);
+
+  // The row's state is up to date now, but if it hasn't been drawn since it
+  // (or the state it starts in) last changed, there's nowhere that says how
+  // to draw it.
+  int in = editorLineState(at - 1);
+  if (row->hl == NULL || row->hlin != in) {
+    if (row->hl == NULL) {
+      row->hl = malloc(row->rsize + 1);
+      if (row->hl == NULL) die("malloc");
+    }
+    row->hlin = in;
+    editorSyntaxLex(row->render, row->rsize, in, row->hl);
+  }
+
+  return row->hl;
+}
+
+/**
+ * @brief Idle task that brings the rest of the file's highlighting state up to
+ *        date, a slice at a time, so that jumping around doesn't have to.
+ * @return 1 while there's more to do.
+ */
+int editorSyntaxIdle() {
+  if (E.syntax == NULL) return 0;
+
+  editorSyntaxUpdate(E.hlvalid + KILO_HL_SLICE);
+  return E.hlvalid < E.numrows;
+}
+
+/**
+ * @brief Throw away all the highlighting, because E.syntax has changed. Every
+ *        row is marked as needing lexing again.
+ */
+void editorSyntaxReset() {
+  struct lineIndex *ix = &E.lineoff;
+  int k, slot;
+
+  for (k = 0; k < ix->nchunks; k++) {
+    struct lineChunk *c = ix->chunks[k];
+    memset(c->hl, KILO_HL_DIRTY, c->n);
+    c->hldirty = c->n;
+  }
+
+  // Freed slots had their hl freed along with them, so they can be gone
+  // through too.
+  for (slot = 0; slot < E.rowpool.used; slot++) {
+    erow *row = rowPoolGet(slot);
+    free(row->hl);
+    row->hl = NULL;
+    row->hlin = HLSTATE_UNKNOWN;
+  }
+
+  E.hlvalid = 0;
+  if (E.syntax != NULL) editorAddIdle(editorSyntaxIdle);
+}
+
+/**
+ * @brief Map a kind of highlighting to an ANSI color.
+ * @param hl One of enum editorHighlight.
+ * @return An SGR foreground color code.
+ */
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    case HL_MATCH: return 34;
+    default: return 37;
+  }
+}
+
+/**
+ * @brief Pick E.syntax based on E.filename.
+ */
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  if (E.filename == NULL) return;
+
+  char *ext = strrchr(E.filename, '.');
+  unsigned int j;
+
+  for (j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    int i;
+
+    for (i = 0; s->filematch[i]; i++) {
+      int isext = s->filematch[i][0] == '.';
+      if (
+        (isext && ext && strcmp(ext, s->filematch[i]) == 0) ||
+        (!isext && strstr(E.filename, s->filematch[i]))
+      ) {
+        E.syntax = s;
+        editorSyntaxReset();
+        return;
+      }
+    }
+  }
+}
+
+/*** UNDO ***/
+
+/**
+ * @brief Work out how many bytes a number takes up as a varint.
+ * @param v The number.
+ * @return Its encoded length.
+ */
+size_t varintLen(uint64_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @brief Encode a number as a varint: 7 bits per byte, lowest first, with the
+ *        top bit set on every byte but the last.
+ * @param p Where to encode it. Needs room for varintLen(v) bytes.
+ * @param v The number.
+ * @return Pointer to just past the encoded number.
+ */
+unsigned char *varintPut(unsigned char *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+/**
+ * @brief Decode a varint.
+ * @param p The encoded number.
+ * @param v Set to the number.
+ * @return Pointer to just past the encoded number.
+ */
+const unsigned char *varintGet(const unsigned char *p, uint64_t *v) {
+  int shift = 0;
+
+  *v = 0;
+  do {
+    *v |= (uint64_t) (*p & 0x7f) << shift;
+    shift += 7;
+  } while (*p++ & 0x80);
+
+  return p;
+}
+
+/**
+ * @brief An undo record, decoded.
+ */
+struct undoRecord {
+  int kind;
+  int flags;
+  int row;
+  int col;
+  const char *text;
+  size_t len;
+};
+
+/**
+ * @brief Decode an undo record.
+ * @param p The encoded record.
+ * @param r Filled in with the record. Its text points into `p`.
+ */
+void editorUndoDecode(const unsigned char *p, struct undoRecord *r) {
+  uint64_t v;
+
+  r->kind = *p & ~(UNDO_BACKWARD | UNDO_GROUP);
+  r->flags = *p & (UNDO_BACKWARD | UNDO_GROUP);
+  p++;
+
+  p = varintGet(p, &v);
+  r->row = v;
+  p = varintGet(p, &v);
+  r->col = v;
+  p = varintGet(p, &v);
+  r->len = v;
+  r->text = (const char *) p;
+}
+
+/**
+ * @brief Encode the open record (if there is one) into the journal.
+ */
+void editorUndoClose() {
+  struct undoLog *u = &E.undo;
+  if (!u->open) return;
+
+  char *text = u->text.b;
+  size_t len = u->text.len;
+  size_t i;
+
+  if (u->flags & UNDO_BACKWARD) {
+    for (i = 0; i < len / 2; i++) {
+      char c = text[i];
+      text[i] = text[len - 1 - i];
+      text[len - 1 - i] = c;
+    }
+  }
+
+  if (u->nrecs == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    unsigned char **recs = realloc(u->recs, sizeof(unsigned char *) * u->cap);
+    if (recs == NULL) die("realloc");
+    u->recs = recs;
+
+    struct arenaMark *marks = realloc(u->marks, sizeof(*marks) * u->cap);
+    if (marks == NULL) die("realloc");
+    u->marks = marks;
+  }
+
+  u->marks[u->nrecs] = arenaGetMark(&u->arena);
+
+  size_t size = 1 + varintLen(u->row) + varintLen(u->col) + varintLen(len);
+  unsigned char *p = (unsigned char *) arenaAlloc(&u->arena, size + len);
+
+  u->recs[u->nrecs++] = p;
+  u->cur = u->nrecs;
+
+  *p++ = u->kind | u->flags;
+  p = varintPut(p, u->row);
+  p = varintPut(p, u->col);
+  p = varintPut(p, len);
+  memcpy(p, text, len);
+
+  abReset(&u->text);
+  u->open = 0;
+}
+
+/**
+ * @brief Record an edit in the journal, adding it to the open record if it
+ *        carries straight on from it.
+ * @param kind UNDO_INSERT or UNDO_DELETE.
+ * @param row Row the char was inserted or deleted at.
+ * @param col Column the char was inserted or deleted at.
+ * @param c The char. '\n' for splitting or joining rows.
+ */
+void editorUndoRecord(int kind, int row, int col, int c) {
+  struct undoLog *u = &E.undo;
+  long long now = editorNow();
+  int merge = u->open && u->kind == kind && now - u->time < KILO_UNDO_GAP;
+  int back = 0;
+
+  if (merge && kind == UNDO_INSERT) {
+    merge = row == u->endrow && col == u->endcol;
+  } else if (merge) {
+    // Delete removes chars from the same place over and over, and Backspace
+    // removes the ones just before the last.
+    int fwd = row == u->row && col == u->col;
+    back = c == '\n'
+      ? row + 1 == u->row && u->col == 0
+      : row == u->row && col + 1 == u->col;
+
+    if (u->text.len > 1) {
+      merge = (u->flags & UNDO_BACKWARD) ? back : fwd;
+    } else {
+      merge = fwd || back;
+    }
+  }
+
+  if (!merge) {
+    editorUndoClose();
+
+    // Whatever was undone can't be redone after a new edit.
+    if (u->cur < u->nrecs) arenaRewind(&u->arena, u->marks[u->cur]);
+    u->nrecs = u->cur;
+
+    u->open = 1;
+    u->kind = kind;
+    u->flags = u->joinnext ? UNDO_GROUP : 0;
+    u->row = u->endrow = row;
+    u->col = u->endcol = col;
+    u->joinnext = 0;
+  } else if (back) {
+    u->row = row;
+    u->col = col;
+    u->flags |= UNDO_BACKWARD;
+  }
+
+  char ch = c;
+  abAppend(&u->text, &ch, 1);
+  u->time = now;
+
+  if (kind == UNDO_INSERT && c == '\n') {
+    u->endrow++;
+    u->endcol = 0;
+  } else if (kind == UNDO_INSERT) {
+    u->endcol++;
+  }
+}
+
+/**
+ * @brief Record that an empty row's been appended to the document in order to
+ *        type into it. It's recorded as a '\n' of its own, which is undone
+ *        along with whatever's typed next.
+ * @param at Index of the new row (the old E.numrows).
+ */
+void editorUndoAppendRow(int at) {
+  editorUndoClose();
+  editorUndoRecord(UNDO_INSERT, at, 0, '\n');
+  editorUndoClose();
+  E.undo.joinnext = 1;
+}
+
+/**
+ * @brief Insert some text into the document, and leave the cursor after it.
+ *        Rows it adds are spliced in all at once, however many there are.
+ * @param row Row to insert it at.
+ * @param col Column to insert it at.
+ * @param s The text, where '\n' splits rows.
+ * @param len Length of the text.
+ */
+void editorUndoInsertText(int row, int col, const char *s, size_t len) {
+  const char *end = s + len;
+  const char *nl = memchr(s, '\n', len);
+
+  if (row == E.numrows) {
+    // The '\n' that appended the last row (see editorUndoAppendRow()).
+    editorInsertRow(row, "", 0);
+    E.cy = row + 1;
+    E.cx = 0;
+    return;
+  }
+
+  erow *r = editorRow(row);
+
+  if (nl == NULL) {
+    editorRowInsertString(r, col, s, len);
+    editorSyntaxEdit(row);
+    E.cy = row;
+    E.cx = col + len;
+    return;
+  }
+
+  // The rest of the row after `col` ends up on the end of the last new row.
+  char *text = editorRowText(r);
+  const char *tail = &text[col];
+  int tlen = r->size - col;
+  int n = E.scan->count(s, len, '\n');
+  const char *p = nl + 1;
+  int i;
+
+  editorInsertRows(row + 1, n);
+
+  for (i = 1; i <= n; i++) {
+    const char *eol = i < n ? memchr(p, '\n', end - p) : end;
+    erow *nr = editorSetRow(editorLine(row + i), p, eol - p, ROW_HEAP);
+
+    if (i == n) {
+      editorRowAppendString(nr, tail, tlen);
+      E.cx = eol - p;
+    }
+    p = eol + 1;
+  }
+
+  editorRowTruncate(r, col);
+  editorRowAppendString(r, s, nl - s);
+  editorSyntaxEdit(row);
+
+  E.cy = row + n;
+}
+
+/**
+ * @brief Delete some text from the document, and leave the cursor where it
+ *        was. Rows it takes out are removed all at once, however many there
+ *        are.
+ * @param row Row the text starts at.
+ * @param col Column the text starts at.
+ * @param len Length of the text, where the end of a row counts as one char.
+ */
+void editorUndoDeleteText(int row, int col, size_t len) {
+  int endrow = row;
+  int endcol = col;
+  int droplast = 0;
+
+  // Work out where the text ends without materializing the rows it covers.
+  for (;;) {
+    int size;
+    editorLineText(endrow, &size);
+
+    if (len <= (size_t) (size - endcol)) {
+      endcol += len;
+      break;
+    }
+
+    len -= size - endcol + 1;
+
+    if (endrow + 1 >= E.numrows) {
+      // The '\n' that appended the last row (see editorUndoAppendRow()).
+      endcol = size;
+      droplast = 1;
+      break;
+    }
+
+    endrow++;
+    endcol = 0;
+  }
+
+  erow *r = editorRow(row);
+
+  if (endrow == row) {
+    int i;
+    for (i = col; i < endcol; i++) editorRowDelChar(r, col);
+  } else {
+    int tlen;
+    char *tail = editorLineText(endrow, &tlen);
+
+    editorRowTruncate(r, col);
+    editorRowAppendString(r, &tail[endcol], tlen - endcol);
+    editorDelRows(row + 1, endrow - row);
+  }
+
+  editorSyntaxEdit(row);
+  if (droplast) editorDelRow(row);
+
+  E.cy = row;
+  E.cx = col;
+}
+
+/**
+ * @brief Undo the most recent edits that haven't been undone yet.
+ */
+void editorUndo() {
+  struct undoLog *u = &E.undo;
+  struct undoRecord r;
+
+  editorUndoClose();
+  if (u->cur == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+
+  do {
+    editorUndoDecode(u->recs[--u->cur], &r);
+
+    if (r.kind == UNDO_INSERT) {
+      editorUndoDeleteText(r.row, r.col, r.len);
+    } else {
+      editorUndoInsertText(r.row, r.col, r.text, r.len);
+      if (!(r.flags & UNDO_BACKWARD)) {
+        E.cy = r.row;
+        E.cx = r.col;
+      }
+    }
+  } while ((r.flags & UNDO_GROUP) && u->cur > 0);
+}
+
+/**
+ * @brief Redo the edits that were undone last.
+ */
+void editorRedo() {
+  struct undoLog *u = &E.undo;
+  struct undoRecord r;
+
+  editorUndoClose();
+  if (u->cur == u->nrecs) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+
+  do {
+    editorUndoDecode(u->recs[u->cur++], &r);
+
+    if (r.kind == UNDO_INSERT) {
+      editorUndoInsertText(r.row, r.col, r.text, r.len);
+    } else {
+      editorUndoDeleteText(r.row, r.col, r.len);
+    }
+  } while (u->cur < u->nrecs && (u->recs[u->cur][0] & UNDO_GROUP));
+}
+
+/**
+ * @brief Throw the whole journal away.
+ */
+void editorUndoFree() {
+  struct undoLog *u = &E.undo;
+
+  arenaFree(&u->arena);
+  free(u->recs);
+  free(u->marks);
+  abFree(&u->text);
+  u->recs = NULL;
+  u->marks = NULL;
+  u->nrecs = 0;
+  u->cap = 0;
+  u->cur = 0;
+  u->open = 0;
+  u->joinnext = 0;
+}
+
+/*** EDITOR OPERATIONS ***/
+
+/**
+ * @brief Insert a char at the cursor, and move the cursor past it.
+ * @param c The char to insert.
+ */
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorUndoAppendRow(E.numrows);
+    editorInsertRow(E.numrows, "", 0);
+  }
+
+  editorUndoRecord(UNDO_INSERT, E.cy, E.cx, c);
+  editorRowInsertChar(editorRow(E.cy), E.cx, c);
+  editorSyntaxEdit(E.cy);
+  E.cx++;
+}
+
+/**
+ * @brief Split the row under the cursor at the cursor, and move the cursor to
+ *        the start of the new row.
+ */
+void editorInsertNewline() {
+  editorUndoRecord(UNDO_INSERT, E.cy, E.cx, '\n');
+  editorSplitRow(E.cy, E.cx);
+
+  E.cy++;
+  E.cx = 0;
+}
+
+/**
+ * @brief Delete the char to the left of the cursor. At the start of a row, the
+ *        row is joined to the end of the one above it instead.
+ */
+void editorDelChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = editorRow(E.cy);
+
+  if (E.cx > 0) {
+    int c = editorRowCharAt(row, E.cx - 1);
+    editorUndoRecord(UNDO_DELETE, E.cy, E.cx - 1, c);
+    editorRowDelChar(row, E.cx - 1);
+    editorSyntaxEdit(E.cy);
+    E.cx--;
+  } else {
+    E.cx = editorRow(E.cy - 1)->size;
+    editorUndoRecord(UNDO_DELETE, E.cy - 1, E.cx, '\n');
+    editorJoinRows(E.cy - 1);
+    E.cy--;
+  }
+}
+
+/*** FILE I/O ***/
+
+/**
+ * @brief Index the next part of E.map into E.lineoff.
+ * @param bytes Roughly how many bytes to index. The actual amount is rounded
+ *              up to the end of a line.
+ * @return 1 if there's more of the file left to index, 0 if it's all done.
+ */
+int editorIndexMore(size_t bytes) {
+  if (E.indexpos == NULL) return 0;
+
+  char *end = E.map + E.mapsize;
+  char *stop = end;
+
+  if ((size_t) (end - E.indexpos) > bytes) {
+    char *from = &E.indexpos[bytes];
+    char *nl = E.scan->find(from, end - from, '\n');
+    if (nl != NULL) stop = nl + 1;
+  }
+
+  char *p = editorAppendLines(E.indexpos, stop, ROW_MAPPED);
+
+  if (stop < end) {
+    E.indexpos = stop;
+    return 1;
+  }
+
+  // The last line may not have a newline after it.
+  if (p < end) editorAppendMapped(p);
+
+  E.indexpos = NULL;
+  return 0;
+}
+
+/**
+ * @brief Make sure the first `n` rows of the file are indexed into E.lineoff
+ *        (or as many as there are, if the file's shorter than that).
+ * @param n Number of rows needed.
+ */
+void editorIndexUntil(int n) {
+  while (E.numrows < n && E.indexpos != NULL) {
+    if (E.pool != NULL) {
+      editorIndexWait();
+      continue;
+    }
+
+    // Guess at how far into the file the nth row is from the rows so far, but
+    // don't bother with slices smaller than a page or so.
+    size_t done = E.indexpos - E.map;
+    size_t guess = E.numrows ? done / E.numrows * (n - E.numrows) : 0;
+    editorIndexMore(guess > 4096 ? guess : 4096);
+  }
+}
+
+/**
+ * @brief Idle task that indexes the rest of E.map, one slice at a time.
+ * @return 1 while there's more to index.
+ */
+int editorIndexIdle() {
+  return editorIndexMore(KILO_INDEX_SLICE);
+}
+
+/**
+ * @brief Body of each thread in the indexing worker pool. Takes chunks until
+ *        there are none left, and fills in their newline tables.
+ * @param arg The pool.
+ */
+void *editorIndexWorker(void *arg) {
+  struct indexPool *pool = arg;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    int i = pool->stop ? pool->nchunks : pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (i >= pool->nchunks) return NULL;
+
+    struct indexChunk *c = &pool->chunks[i];
+    size_t cap = 0;
+    char *p = c->start;
+    char *nl;
+
+    while ((nl = E.scan->find(p, c->end - p, '\n')) != NULL) {
+      if (c->nnl == cap) {
+        cap = cap ? cap * 2 : 4096;
+        uint32_t *table = realloc(c->nl, sizeof(uint32_t) * cap);
+        if (table == NULL) {
+          char err = ENOMEM;
+          write(pool->notify[1], &err, 1);
+          return NULL;
+        }
+        c->nl = table;
+      }
+
+      c->nl[c->nnl++] = nl - c->start;
+      p = nl + 1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    c->done = 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    write(pool->notify[1], "", 1);
+  }
+}
+
+/**
+ * @brief Turn every finished chunk that's next in line into rows, by walking
+ *        its newline table. Once the last chunk's done, the pool is shut down.
+ * @return 1 if any chunks were stitched, 0 otherwise.
+ */
+int editorIndexStitch() {
+  struct indexPool *pool = E.pool;
+  int any = 0;
+
+  while (pool->stitched < pool->nchunks) {
+    struct indexChunk *c = &pool->chunks[pool->stitched];
+
+    pthread_mutex_lock(&pool->lock);
+    int done = c->done;
+    pthread_mutex_unlock(&pool->lock);
+    if (!done) break;
+
+    // Rows begin where the last one ended, which may be in an earlier chunk.
+    int at = editorAppendRows(c->nnl);
+    char *p = E.indexpos;
+    size_t i;
+
+    for (i = 0; i < c->nnl; i++) {
+      *editorLine(at++) = p - E.map;
+      p = &c->start[c->nl[i] + 1];
+    }
+
+    E.indexpos = p;
+    free(c->nl);
+    c->nl = NULL;
+    pool->stitched++;
+    any = 1;
+  }
+
+  if (pool->stitched == pool->nchunks) {
+    char *end = E.map + E.mapsize;
+    char *p = E.indexpos;
+
+    editorIndexStop();
+
+    // The last line may not have a newline after it.
+    if (p < end) editorAppendMapped(p);
+
+    E.indexpos = NULL;
+  }
+
+  return any;
+}
+
+/**
+ * @brief Empty the worker pool's notification pipe. If a worker's sent an
+ *        errno rather than a 0, the pool is stopped and the editor exits with
+ *        it, here on the main thread.
+ * @param fd The read end of the pipe.
+ */
+void editorIndexDrain(int fd) {
+  char drain[64];
+  ssize_t n, i;
+  int err = 0;
+
+  while ((n = read(fd, drain, sizeof(drain))) > 0) {
+    for (i = 0; i < n && err == 0; i++) err = (unsigned char) drain[i];
+  }
+
+  if (err != 0) {
+    editorIndexStop();
+    errno = err;
+    die("index");
+  }
+}
+
+/**
+ * @brief Event loop handler for the worker pool's notification pipe.
+ * @param fd The read end of the pipe.
+ */
+void editorIndexNotified(int fd) {
+  editorIndexDrain(fd);
+  editorIndexStitch();
+}
+
+/**
+ * @brief Block until the worker pool has finished at least one more chunk that
+ *        can be stitched, and stitch it.
+ */
+void editorIndexWait() {
+  while (E.pool != NULL && !editorIndexStitch()) {
+    struct pollfd pfd = { E.pool->notify[0], POLLIN, 0 };
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+
+    editorIndexDrain(pfd.fd);
+  }
+}
+
+/**
+ * @brief Start a worker pool to index the rest of E.map, from E.indexpos on.
+ * @return 0 on success, or -1 if there's too little left to be worth it (or a
+ *         pool can't be started), in which case nothing is changed.
+ */
+int editorIndexStart() {
+  char *end = E.map + E.mapsize;
+  size_t left = end - E.indexpos;
+  if (left < 2 * (size_t) KILO_INDEX_CHUNK) return -1;
+
+  struct indexPool *pool = calloc(1, sizeof(struct indexPool));
+  if (pool == NULL) return -1;
+
+  pool->nchunks = (left + KILO_INDEX_CHUNK - 1) / KILO_INDEX_CHUNK;
+  pool->chunks = calloc(pool->nchunks, sizeof(struct indexChunk));
+  if (pool->chunks == NULL || pipe(pool->notify) == -1) {
+    free(pool->chunks);
+    free(pool);
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(pool->notify[i], F_SETFL, O_NONBLOCK);
+    fcntl(pool->notify[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  for (i = 0; i < pool->nchunks; i++) {
+    pool->chunks[i].start = &E.indexpos[(size_t) i * KILO_INDEX_CHUNK];
+    pool->chunks[i].end = i == pool->nchunks - 1
+      ? end
+      : pool->chunks[i].start + KILO_INDEX_CHUNK;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int want = ncpu < 1 ? 1 : ncpu > KILO_MAX_INDEX_THREADS
+    ? KILO_MAX_INDEX_THREADS
+    : (int) ncpu;
+  if (want > pool->nchunks) want = pool->nchunks;
+
+  while (pool->nthreads < want) {
+    pthread_t *t = &pool->threads[pool->nthreads];
+    if (pthread_create(t, NULL, editorIndexWorker, pool) != 0) break;
+    pool->nthreads++;
+  }
+
+  E.pool = pool;
+
+  if (pool->nthreads == 0) {
+    editorIndexStop();
+    return -1;
+  }
+
+  editorWatchFd(pool->notify[0], editorIndexNotified);
+  return 0;
+}
+
+/**
+ * @brief Stop the worker pool (if it's running), wait for its threads to finish
+ *        and free it. Chunks that haven't been stitched yet are thrown away.
+ */
+void editorIndexStop() {
+  struct indexPool *pool = E.pool;
+  if (pool == NULL) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_mutex_unlock(&pool->lock);
+
+  int i;
+  for (i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  for (i = 0; i < pool->nchunks; i++) {
+    free(pool->chunks[i].nl);
+  }
+
+  editorUnwatchFd(pool->notify[0]);
+  close(pool->notify[0]);
+  close(pool->notify[1]);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->chunks);
+  free(pool);
+  E.pool = NULL;
+}
+
+/**
+ * @brief Set E.crlf from the first line ending in the start of a file.
+ * @param p The start of the file.
+ * @param len How much of it there is.
+ * @return 1 if there was a line ending to go by, 0 if not.
+ */
+int editorDetectEol(const char *p, size_t len) {
+  const char *nl = E.scan->find(p, len, '\n');
+  if (nl == NULL) return 0;
+
+  E.crlf = nl > p && nl[-1] == '\r';
+  return 1;
+}
+
+/**
+ * @brief Map a regular file into memory and point the rows straight into it.
+ *        Only the rows for the first screen are indexed straight away; the
+ *        rest are indexed by an idle task, or on demand (see
+ *        editorIndexUntil()). The file's bytes are paged in by the kernel as
+ *        they're touched.
+ * @param fd An open file descriptor for the file.
+ * @return 0 on success, or -1 if the file can't be mapped (it's empty, not a
+ *         regular file, or mmap() failed), in which case nothing is changed.
+ */
+int editorOpenMapped(int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return -1;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+
+  E.map = map;
+  E.mapsize = st.st_size;
+  E.mapowned = 1;
+  E.indexpos = map;
+  editorDetectEol(map, st.st_size);
+
+  // Index just enough to fill the first screen, and leave the rest to be done
+  // in the background: by the worker pool if there's a lot left, or by the
+  // event loop if not.
+  editorIndexUntil(E.screenrows);
+  if (E.indexpos != NULL && editorIndexStart() == -1) {
+    editorAddIdle(editorIndexIdle);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Make a buffer that's already in memory the document, indexing all of
+ *        it straight away, as if it were a mapped file. The buffer still
+ *        belongs to the caller, and isn't unmapped or freed along with the
+ *        rows, but has to outlive them.
+ * @param buf The buffer.
+ * @param len Length of the buffer.
+ */
+void editorOpenBuffer(char *buf, size_t len) {
+  editorFreeRows();
+
+  E.map = buf;
+  E.mapsize = len;
+  E.mapowned = 0;
+  E.indexpos = buf;
+  editorIndexMore(len);
+}
+
+/**
+ * @brief Read a file that can't be mapped into the document, in big blocks.
+ *        Rows are copied into E.arena.
+ * @param fd An open file descriptor for the file.
+ */
+void editorOpenStream(int fd) {
+  size_t cap = KILO_READ_BLOCK;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  int detected = 0;
+  if (buf == NULL) die("malloc");
+
+  while (1) {
+    // Only a line longer than the whole buffer can fill it up.
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+      if (buf == NULL) die("realloc");
+    }
+
+    ssize_t nread = read(fd, &buf[len], cap - len);
+    if (nread == -1) {
+      if (errno == EINTR) continue;
+      die("read");
+    }
+    if (nread == 0) break;
+
+    len += nread;
+    if (!detected) detected = editorDetectEol(buf, len);
+
+    // Keep whatever's left of the last line for the next block.
+    char *rest = editorAppendLines(buf, &buf[len], ROW_ARENA);
+    len -= rest - buf;
+    memmove(buf, rest, len);
+  }
+
+  if (len > 0) {
+    while (len > 0 && buf[len - 1] == '\r') len--;
+    editorAppendRow(buf, len);
+  }
+
+  free(buf);
+}
+
+/**
+ * @brief Read a file into the document. Regular files are memory-mapped;
+ *        anything else (pipes, empty files, etc.) is read in blocks into
+ *        E.arena.
+ * @param filename The file to read.
+ */
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+  if (E.filename == NULL) die("strdup");
+
+  editorSelectSyntaxHighlight();
+  E.crlf = 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  if (editorOpenMapped(fd) == 0) {
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    return;
+  }
+
+  editorOpenStream(fd);
+  close(fd);
+}
+
+/**
+ * @brief Add some bytes to the end of a save job's snapshot. Bytes that carry
+ *        straight on from the last ones added are merged into the same iovec.
+ * @param job The save job.
+ * @param p The bytes. They mustn't change until the job's finished.
+ * @param len Number of bytes.
+ */
+void editorSaveAppend(struct saveJob *job, const char *p, size_t len) {
+  if (len == 0) return;
+  job->size += len;
+
+  if (job->niov > 0) {
+    struct iovec *last = &job->iov[job->niov - 1];
+    if ((char *) last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+
+  if (job->niov == job->cap) {
+    job->cap = job->cap ? job->cap * 2 : 64;
+    struct iovec *iov = realloc(job->iov, sizeof(struct iovec) * job->cap);
+    if (iov == NULL) die("realloc");
+    job->iov = iov;
+  }
+
+  job->iov[job->niov].iov_base = (void *) p;
+  job->iov[job->niov].iov_len = len;
+  job->niov++;
+}
+
+/**
+ * @brief Measure the line ending at `p` in E.map.
+ * @param p Somewhere in E.map.
+ * @return Length of the carriage returns and newline at `p`, or 0 if `p`
+ *         isn't at the end of a line.
+ */
+size_t editorSaveEol(const char *p) {
+  const char *end = E.map + E.mapsize;
+  const char *q = p;
+
+  while (q < end && *q == '\r') q++;
+  return q < end && *q == '\n' ? (size_t) (q + 1 - p) : 0;
+}
+
+/**
+ * @brief Add the file's line ending (see E.crlf) to a save job's snapshot.
+ * @param job The save job.
+ */
+void editorSaveNewline(struct saveJob *job) {
+  if (E.crlf) editorSaveAppend(job, "\r\n", 2);
+  else editorSaveAppend(job, "\n", 1);
+}
+
+/**
+ * @brief Add a run of consecutive lines of E.map to a save job's snapshot,
+ *        along with the last one's line ending (or the file's, if it's lost
+ *        it).
+ * @param job The save job.
+ * @param start Start of the first row in the run.
+ * @param end End of the last row's text, or NULL if the last row's unloaded
+ *            (and so is the whole of its line).
+ * @param last Start of the last row in the run.
+ */
+void editorSaveRun(
+  struct saveJob *job,
+  const char *start,
+  const char *end,
+  const char *last
+) {
+  size_t eol;
+
+  if (end == NULL) {
+    const char *mapend = E.map + E.mapsize;
+    end = E.scan->find(last, mapend - last, '\n');
+    eol = end != NULL;
+    if (end == NULL) end = mapend;
+  } else {
+    eol = editorSaveEol(end);
+  }
+
+  editorSaveAppend(job, start, end + eol - start);
+  if (eol == 0) editorSaveNewline(job);
+}
+
+/**
+ * @brief Snapshot the document into a save job. Rows still backed by E.map
+ *        are written out with their original line endings, in as few iovecs
+ *        as possible; every other row ends in the file's line ending, so
+ *        editing a CRLF file doesn't leave it with a mix of the two.
+ * @param job The save job.
+ */
+void editorSaveSnapshot(struct saveJob *job) {
+  // The run of E.map being built up, if any; see editorSaveRun().
+  const char *runstart = NULL;
+  const char *runend = NULL;
+  const char *last = NULL;
+  int i;
+
+  for (i = 0; i < E.numrows; i++) {
+    uint64_t line = *editorLine(i);
+    int loaded = (line & KILO_LINE_LOADED) != 0;
+    erow *row = loaded ? rowPoolGet(line & ~KILO_LINE_LOADED) : NULL;
+    const char *start = NULL;
+
+    if (!loaded) {
+      start = &E.map[line];
+    } else if (row->storage == ROW_MAPPED) {
+      start = row->chars;
+    }
+
+    // An unloaded row is always followed by the next line of the file, if
+    // it's followed by a mapped row at all (see editorDelRow()). Loaded rows
+    // may have been cut short, so check that their line's still all there.
+    int carries = start != NULL &&
+      (runend == NULL || runend + editorSaveEol(runend) == start);
+
+    if (runstart != NULL && !carries) {
+      editorSaveRun(job, runstart, runend, last);
+      runstart = NULL;
+    }
+
+    if (start != NULL) {
+      if (runstart == NULL) runstart = start;
+      runend = loaded ? start + row->size : NULL;
+      last = start;
+    } else if (row->storage == ROW_ARENA) {
+      // Arena rows never change either (editing one copies it).
+      editorSaveAppend(job, row->chars, row->size);
+      editorSaveNewline(job);
+    } else {
+      char *copy = arenaAlloc(&job->copies, row->size + 2);
+      int tail = row->size - row->gap;
+      int len = row->size;
+
+      memcpy(copy, row->chars, row->gap);
+      memcpy(&copy[row->gap], &row->chars[row->gap + row->gaplen], tail);
+      if (E.crlf) copy[len++] = '\r';
+      copy[len++] = '\n';
+      editorSaveAppend(job, copy, len);
+    }
+  }
+
+  if (runstart != NULL) editorSaveRun(job, runstart, runend, last);
+
+  // Whatever hasn't been indexed yet can't have been edited, either.
+  if (E.indexpos != NULL) {
+    char *end = E.map + E.mapsize;
+    editorSaveAppend(job, E.indexpos, end - E.indexpos);
+    if (end[-1] != '\n') editorSaveNewline(job);
+  }
+}
+
+/**
+ * @brief Write a save job's snapshot to a file, and flush it to disk.
+ * @param job The save job. Its iov is used up.
+ * @param fd The file.
+ * @return 0 on success, or -1 (with errno set) on failure.
+ */
+int editorSaveWrite(struct saveJob *job, int fd) {
+  struct iovec *iov = job->iov;
+  int left = job->niov;
+
+  while (left > 0) {
+    ssize_t n = writev(fd, iov, left < IOV_MAX ? left : IOV_MAX);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    // Skip whatever was written, which may well end partway through an iovec.
+    while (left > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      left--;
+    }
+    if (left > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return fsync(fd);
+}
+
+/**
+ * @brief fsync() the directory a file's in, so that a rename into it sticks.
+ *        This is only best effort, since not every filesystem can.
+ * @param path The file.
+ */
+void editorSaveSyncDir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".") : strndup(path, slash - path);
+  if (dir == NULL) return;
+
+  int fd = open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+
+  free(dir);
+}
+
+/**
+ * @brief Body of the save thread. Writes the snapshot to a temp file in the
+ *        same directory as the file, and renames it over the file.
+ * @param arg The save job.
+ */
+void *editorSaveWorker(void *arg) {
+  struct saveJob *job = arg;
+  size_t len = strlen(job->path) + sizeof(".XXXXXX");
+  char *tmp = malloc(len);
+
+  if (tmp == NULL) {
+    job->err = ENOMEM;
+  } else {
+    snprintf(tmp, len, "%s.XXXXXX", job->path);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+      job->err = errno;
+    } else {
+      // Keep the file's permissions; mkstemp() only lets the owner in.
+      struct stat st;
+      mode_t mode = stat(job->path, &st) == 0 ? st.st_mode & 07777 : 0644;
+
+      if (fchmod(fd, mode) == -1 || editorSaveWrite(job, fd) == -1) {
+        job->err = errno;
+      }
+      if (close(fd) == -1 && job->err == 0) job->err = errno;
+      if (job->err == 0 && rename(tmp, job->path) == -1) job->err = errno;
+
+      if (job->err == 0) {
+        editorSaveSyncDir(job->path);
+      } else {
+        unlink(tmp);
+      }
+    }
+
+    free(tmp);
+  }
+
+  write(job->notify[1], "", 1);
+  return NULL;
+}
+
+/**
+ * @brief Free a save job.
+ * @param job The save job.
+ */
+void editorSaveFree(struct saveJob *job) {
+  close(job->notify[0]);
+  close(job->notify[1]);
+  arenaFree(&job->copies);
+  free(job->iov);
+  free(job->path);
+  free(job);
+}
+
+/**
+ * @brief Event loop handler for the save thread's notification pipe. Reports
+ *        how the save went, and starts the next one if another's been asked
+ *        for in the meantime.
+ * @param fd The read end of the pipe.
+ */
+void editorSaveDone(int fd) {
+  struct saveJob *job = E.save;
+
+  char drain[64];
+  while (read(fd, drain, sizeof(drain)) > 0);
+
+  pthread_join(job->thread, NULL);
+  editorUnwatchFd(fd);
+  E.save = NULL;
+
+  if (job->err == 0) {
+    // Only the changes made before the snapshot have been saved.
+    E.dirty -= job->dirty;
+    editorSetStatusMessage("%zu bytes written to disk", job->size);
+  } else {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  }
+
+  editorSaveFree(job);
+
+  if (E.savepending) {
+    E.savepending = 0;
+    editorSave();
+  }
+}
+
+/**
+ * @brief Block until there's no save running, including any that were asked
+ *        for while one was.
+ */
+void editorSaveWait() {
+  while (E.save != NULL) {
+    struct pollfd pfd = { E.save->notify[0], POLLIN, 0 };
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+
+    editorSaveDone(pfd.fd);
+  }
+}
+
+/**
+ * @brief Prompt callback for naming a file that doesn't have a name yet.
+ * @param name What's been typed.
+ * @param key The key that was pressed.
+ */
+void editorSaveAsCallback(char *name, int key) {
+  if (key == '\x1b' || (key == '\r' && name[0] == '\0')) {
+    editorSetStatusMessage("Save aborted");
+  } else if (key == '\r') {
+    E.filename = strdup(name);
+    if (E.filename == NULL) die("strdup");
+
+    editorSelectSyntaxHighlight();
+    editorSave();
+  }
+}
+
+/**
+ * @brief Save the document to E.filename, asking for a name first if there
+ *        isn't one. The file's written by a background thread; this only
+ *        takes a snapshot of the rows, so the editor carries on as normal
+ *        while it's saved. If a save is already running, another one is done
+ *        once it's finished.
+ */
+void editorSave() {
+  if (E.filename == NULL) {
+    editorPromptStart("Save as: %s (ESC to cancel)", editorSaveAsCallback);
+    return;
+  }
+
+  if (E.save != NULL) {
+    E.savepending = 1;
+    return;
+  }
+
+  struct saveJob *job = calloc(1, sizeof(struct saveJob));
+  if (job == NULL) die("calloc");
+
+  job->path = strdup(E.filename);
+  if (job->path == NULL) die("strdup");
+  job->copies = (struct arena) ARENA_INIT;
+  job->dirty = E.dirty;
+
+  if (pipe(job->notify) == -1) {
+    editorSetStatusMessage("Can't save! %s", strerror(errno));
+    free(job->path);
+    free(job);
+    return;
+  }
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(job->notify[i], F_SETFL, O_NONBLOCK);
+    fcntl(job->notify[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  editorSaveSnapshot(job);
+
+  int err = pthread_create(&job->thread, NULL, editorSaveWorker, job);
+  if (err != 0) {
+    editorSetStatusMessage("Can't save! %s", strerror(err));
+    editorSaveFree(job);
+    return;
+  }
+
+  E.save = job;
+  editorWatchFd(job->notify[0], editorSaveDone);
+  editorSetStatusMessage("Saving...");
+}
+
+/*** APPEND BUFFER ***/
+
+/**
+ * @brief Make sure an abuf has room for `n` more chars. The buffer at least
+ *        doubles whenever it has to grow, so appends are amortized O(1).
+ * @param ab A pointer to the appendable buffer.
+ * @param n The number of chars about to be appended.
+ * @return 0 on success, or -1 if the buffer couldn't be grown.
+ */
+int abReserve(struct abuf *ab, int n) {
+  if (ab->cap - ab->len >= n) return 0;
+
+  int cap = ab->cap ? ab->cap * 2 : KILO_ABUF_INIT_CAP;
+  if (cap < ab->len + n) cap = ab->len + n;
+
+  char *new = realloc(ab->b, cap);
+  if (new == NULL) return -1;
+
+  ab->b = new;
+  ab->cap = cap;
+  return 0;
+}
+
+/**
+ * @brief Append a string of char's to an instance of abuf.
+ * @param abuf A pointer to the appendable buffer.
+ * @param s The string of char's to be appended.
+ * @param len The length of the string to be appended.
+ */
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (len <= 0 || abReserve(ab, len) == -1) return;
+
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+/**
+ * @brief Append `n` copies of a char to an instance of abuf.
+ * @param abuf A pointer to the appendable buffer.
+ * @param c The char to be appended.
+ * @param n How many times to append it.
+ */
+void abAppendN(struct abuf *ab, char c, int n) {
+  if (n <= 0 || abReserve(ab, n) == -1) return;
+
+  memset(&ab->b[ab->len], c, n);
+  ab->len += n;
+}
+
+/**
+ * @brief Empty an appendable buffer, but keep its memory around for reuse.
+ */
+void abReset(struct abuf *ab) {
+  ab->len = 0;
+}
+
+/**
+ * @brief Free an appendable buffer from memory.
+ */
+void abFree(struct abuf *ab) {
+  free(ab->b);
+  ab->b = NULL;
+  ab->len = 0;
+  ab->cap = 0;
+}
+
+/*** STATS ***/
+
+#ifdef KILO_STATS
+/**
+ * @brief Get the time from a monotonic clock, for timing things in frames.
+ * @return Microseconds since some arbitrary point in the past.
+ */
+long long editorStatsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Find the statsHistogram bucket a value goes in.
+ * @param v The value.
+ * @return Index of the bucket.
+ */
+int editorStatsBucket(uint64_t v) {
+  if (v < 16) return v;
+
+  int e = 63 - __builtin_clzll(v);
+  int b = 16 + (e - 4) * 8 + ((v >> (e - 3)) & 7);
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/**
+ * @brief Find the smallest value that goes in a statsHistogram bucket.
+ * @param b Index of the bucket.
+ * @return The value.
+ */
+uint64_t editorStatsBucketLow(int b) {
+  if (b < 16) return b;
+
+  int e = (b - 16) / 8 + 4;
+  return (uint64_t) (8 + (b - 16) % 8) << (e - 3);
+}
+
+/**
+ * @brief Add a value to a histogram.
+ * @param h The histogram.
+ * @param v The value.
+ */
+void editorStatsAdd(struct statsHistogram *h, uint64_t v) {
+  h->buckets[editorStatsBucket(v)]++;
+  h->count++;
+  if (v > h->max) h->max = v;
+}
+
+/**
+ * @brief Estimate a percentile of the values in a histogram.
+ * @param h The histogram.
+ * @param p The percentile, from 0 to 1.
+ * @return The smallest value in the bucket the percentile falls in, or 0 if
+ *         the histogram's empty.
+ */
+uint64_t editorStatsPercentile(struct statsHistogram *h, double p) {
+  if (h->count == 0) return 0;
+
+  uint64_t rank = (uint64_t) (p * (h->count - 1)) + 1;
+  uint64_t seen = 0;
+  int b;
+
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank) break;
+  }
+
+  uint64_t low = editorStatsBucketLow(b);
+  return low < h->max ? low : h->max;
+}
+
+/**
+ * @brief Record everything measured since the last frame as another frame.
+ * @param wrote Whether the frame was written out.
+ */
+void editorStatsFrame(int wrote) {
+  struct editorStats *st = &E.stats;
+  int i;
+
+  for (i = 0; i < STAT_COUNT; i++) {
+    if (i == STAT_KEYS && !st->keys) continue;
+    if ((i == STAT_WRITE || i == STAT_BYTES) && !wrote) continue;
+    editorStatsAdd(&st->hist[i], st->cur[i]);
+  }
+
+  memset(st->cur, 0, sizeof(st->cur));
+  st->keys = 0;
+}
+
+/**
+ * @brief Format a value of one of the stats, with its unit.
+ * @param buf Where to put it.
+ * @param n Size of buf.
+ * @param stat Which stat the value's for (one of enum editorStat).
+ * @param v The value.
+ */
+void editorStatsFormat(char *buf, size_t n, int stat, uint64_t v) {
+  unsigned long long u = v;
+
+  if (stat == STAT_READS) {
+    snprintf(buf, n, "%llu", u);
+  } else if (stat == STAT_BYTES) {
+    snprintf(buf, n, u < 10240 ? "%lluB" : "%lluK", u < 10240 ? u : u >> 10);
+  } else {
+    snprintf(buf, n, u < 10000 ? "%lluus" : "%llums", u < 10000 ? u : u / 1000);
+  }
+}
+
+/**
+ * @brief Write the p50 and p99 of every stat into a line for the message bar.
+ * @param buf Where to put it.
+ * @param n Size of buf.
+ */
+void editorStatsOverlay(char *buf, size_t n) {
+  static const char *names[STAT_COUNT] = {
+    "key", "draw", "write", "out", "rd"
+  };
+  size_t len = snprintf(buf, n, "p50/p99");
+  int i;
+
+  for (i = 0; i < STAT_COUNT && len < n; i++) {
+    char p50[16], p99[16];
+    editorStatsFormat(p50, sizeof(p50), i,
+        editorStatsPercentile(&E.stats.hist[i], 0.5));
+    editorStatsFormat(p99, sizeof(p99), i,
+        editorStatsPercentile(&E.stats.hist[i], 0.99));
+    len += snprintf(&buf[len], n - len, " %s %s/%s", names[i], p50, p99);
+  }
+}
+
+/**
+ * @brief Write every stat's histogram to $KILO_STATS_FILE (or
+ *        KILO_STATS_FILE), for looking at after kilo's exited.
+ */
+void editorStatsDump() {
+  static const char *names[STAT_COUNT] = {
+    "keypress (us)", "draw (us)", "write (us)", "bytes written", "reads"
+  };
+
+  const char *path = getenv("KILO_STATS_FILE");
+  FILE *fp = fopen(path ? path : KILO_STATS_FILE, "w");
+  if (fp == NULL) return;
+
+  int i, b;
+  for (i = 0; i < STAT_COUNT; i++) {
+    struct statsHistogram *h = &E.stats.hist[i];
+
+    fprintf(fp, "%s: %llu frames, p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+        names[i],
+        (unsigned long long) h->count,
+        (unsigned long long) editorStatsPercentile(h, 0.5),
+        (unsigned long long) editorStatsPercentile(h, 0.9),
+        (unsigned long long) editorStatsPercentile(h, 0.99),
+        (unsigned long long) h->max);
+
+    for (b = 0; b < STATS_BUCKETS; b++) {
+      if (h->buckets[b] == 0) continue;
+      fprintf(fp, "  %12llu .. %-12llu %llu\n",
+          (unsigned long long) editorStatsBucketLow(b),
+          (unsigned long long) editorStatsBucketLow(b + 1) - 1,
+          (unsigned long long) h->buckets[b]);
+    }
+
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+}
+#endif
+
+/*** OUTPUT ***/
+
+/**
+ * @brief Resize E.frame to match the size of the screen. The frame is marked
+ *        invalid, so the next redraw repaints everything.
+ */
+void editorFrameResize() {
+  struct screenFrame *f = &E.frame;
+  int nrows = E.screenrows + 2;
+  int i;
+
+  // Rows that are still on screen keep their buffers, so that the repaint
+  // after a resize doesn't have to allocate them all again.
+  for (i = nrows; i < f->nrows; i++) {
+    abFree(&f->rows[i]);
+  }
+
+  struct abuf *rows = realloc(f->rows, sizeof(struct abuf) * nrows);
+  if (rows == NULL) die("realloc");
+
+  for (i = f->nrows; i < nrows; i++) {
+    rows[i] = (struct abuf) ABUF_INIT;
+  }
+
+  // The status bar and message bar go under the text.
+  f->rows = rows;
+  f->nrows = nrows;
+
+  // There's no telling what the terminal did with what was on it, so the next
+  // redraw repaints every row.
+  f->valid = 0;
+}
+
+/**
+ * @brief Scroll the screen so that the cursor's on it.
+ */
+void editorScroll() {
+  E.rx = E.cy < E.numrows ? editorRowCxToRx(editorRow(E.cy), E.cx) : 0;
+
+  if (E.cy < E.rowoff) E.rowoff = E.cy;
+  if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
+  if (E.rx < E.coloff) E.coloff = E.rx;
+  if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+}
+
+/**
+ * @brief Ask the kernel to start reading in the parts of E.map just above and
+ *        below the screen, so that they're (hopefully) paged in by the time
+ *        they're scrolled to. Only done when the screen's scrolled.
+ */
+void editorPrefetch() {
+  if (E.map == NULL || E.rowoff == E.prefetchoff) return;
+  E.prefetchoff = E.rowoff;
+
+  int from = E.rowoff > KILO_PREFETCH_ROWS ? E.rowoff - KILO_PREFETCH_ROWS : 0;
+  int to = E.rowoff + E.screenrows + KILO_PREFETCH_ROWS;
+  if (to > E.numrows) to = E.numrows;
+
+  // Find the span of the file that the rows in the margin start in. Rows that
+  // aren't in E.map are skipped; mapped rows either say where they start in
+  // E.lineoff or point there.
+  char *lo = NULL;
+  char *hi = NULL;
+  int i;
+
+  for (i = from; i < to; i++) {
+    uint64_t line = *editorLine(i);
+    char *p;
+
+    if (!(line & KILO_LINE_LOADED)) {
+      p = &E.map[line];
+    } else if (rowPoolGet(line & ~KILO_LINE_LOADED)->storage == ROW_MAPPED) {
+      p = rowPoolGet(line & ~KILO_LINE_LOADED)->chars;
+    } else {
+      continue;
+    }
+
+    if (lo == NULL || p < lo) lo = p;
+    if (hi == NULL || p > hi) hi = p;
+  }
+
+  if (lo == NULL) return;
+
+  long page = sysconf(_SC_PAGESIZE);
+  char *start = E.map + ((lo - E.map) & ~(page - 1));
+  size_t len = hi - start + page;
+  if (start + len > E.map + E.mapsize) len = E.map + E.mapsize - start;
+
+  madvise(start, len, MADV_WILLNEED);
+}
+
+/**
+ * @brief Work out how to draw one column of a row.
+ * @param hl The row's highlighting, or NULL if there isn't any.
+ * @param rx The column.
+ * @param mstart First column of a search match to draw over the top, or -1.
+ * @param mend One past the last column of the search match.
+ * @return One of enum editorHighlight.
+ */
+int editorHighlightAt(unsigned char *hl, int rx, int mstart, int mend) {
+  if (rx >= mstart && rx < mend) return HL_MATCH;
+  return hl != NULL ? hl[rx] : HL_NORMAL;
+}
+
+/**
+ * @brief Draw what should be on one screen row: the part of a row of the
+ *        document that's on screen, or a tilde past the end of the document.
+ * @param ab Appendable buffer to draw to. At most E.screencols chars are
+ *           appended, plus color escape sequences if E.syntax is set.
+ * @param i The screen row to draw.
+ */
+void editorDrawRow(struct abuf *ab, int i) {
+  int filerow = i + E.rowoff;
+
+  if (filerow >= E.numrows) {
+    // Draw tildes all the way down, as well as a welcome message 1/3 of the way
+    // down (if there's no file being opened).
+    if (E.numrows == 0 && i == E.screenrows / 3) {
+      char welcome[80];
+
+      int welcomelen = snprintf(
+        welcome,
+        sizeof(welcome),
+        "Kilo editor -- version %s",
+        KILO_VERSION
+      );
+
+      if (welcomelen > E.screencols) welcomelen = E.screencols;
+
+      // Center the greeting.
+      int padding = (E.screencols - welcomelen) / 2;
+      if (padding) {
+        abAppend(ab, "~", 1);
+        padding--;
       }
-    } else if (seq[0] == 'O') {
-      // Some systems use 'O' instead of '[' in some of their escape codes.
-      switch (seq[1]) {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
+
+      abAppendN(ab, ' ', padding);
+
+      abAppend(ab, welcome, welcomelen);
+    } else {
+      abAppend(ab, "~", 1);
+    }
+  } else {
+    erow *row = editorRow(filerow);
+    char *render = editorRowRender(row);
+
+    int len = row->rsize - E.coloff;
+    if (len > E.screencols) len = E.screencols;
+    if (len <= 0) return;
+
+    // The search match the cursor's on is highlighted over the top of
+    // everything else.
+    int mstart = -1;
+    int mend = -1;
+    struct editorSearch *search = &E.search;
+    if (search->active && search->current != -1) {
+      struct searchMatch *m = &search->matches[search->current];
+      if (m->row == filerow) {
+        mstart = editorRowCxToRx(row, m->col);
+        mend = editorRowCxToRx(row, m->col + search->qlen);
       }
     }
 
-    // Give up and just return <Escape>.
-    return '\x1b';
+    if (E.syntax == NULL && mstart == -1) {
+      abAppend(ab, &render[E.coloff], len);
+      return;
+    }
+
+    // Draw runs of chars highlighted the same way, switching colors between
+    // them.
+    unsigned char *hl = E.syntax != NULL ? editorRowHighlight(filerow) : NULL;
+    int color = -1;
+    int j = E.coloff;
+    int stop = E.coloff + len;
+
+    while (j < stop) {
+      int kind = editorHighlightAt(hl, j, mstart, mend);
+      int run = j + 1;
+      while (run < stop && editorHighlightAt(hl, run, mstart, mend) == kind) {
+        run++;
+      }
+
+      int want = kind == HL_NORMAL ? -1 : editorSyntaxToColor(kind);
+      if (want != color) {
+        char buf[16];
+        int n = snprintf(buf, sizeof(buf), "\x1b[%dm", want == -1 ? 39 : want);
+        abAppend(ab, buf, n);
+        color = want;
+      }
+
+      abAppend(ab, &render[j], run - j);
+      j = run;
+    }
+
+    if (color != -1) abAppend(ab, "\x1b[39m", 5);
+  }
+}
+
+/**
+ * @brief Draw the status bar: the file's name and size on the left, and where
+ *        the cursor is on the right, in inverted colors.
+ * @param ab Appendable buffer to draw to.
+ */
+void editorDrawStatusBar(struct abuf *ab) {
+  char status[80];
+  char rstatus[80];
+
+  abAppend(ab, "\x1b[7m", 4);
+
+  int len = snprintf(
+    status,
+    sizeof(status),
+    "%.20s - %d%s lines %s",
+    E.filename ? E.filename : "[No Name]",
+    E.numrows,
+    E.indexpos != NULL ? "+" : "",
+    E.dirty ? "(modified)" : ""
+  );
+
+  int rlen = snprintf(
+    rstatus,
+    sizeof(rstatus),
+    "%s | %d/%d",
+    E.syntax ? E.syntax->filetype : "no ft",
+    E.cy + 1,
+    E.numrows
+  );
+
+  if (len > E.screencols) len = E.screencols;
+  abAppend(ab, status, len);
+
+  if (len + rlen <= E.screencols) {
+    abAppendN(ab, ' ', E.screencols - len - rlen);
+    abAppend(ab, rstatus, rlen);
   } else {
-    return c;
+    abAppendN(ab, ' ', E.screencols - len);
   }
+
+  abAppend(ab, "\x1b[m", 3);
 }
 
 /**
- * @brief Get the current cursor position.
- * @param rows Pointer to how many rows over the cursor is.
- * @param cols Pointer to how many columns down the cursor is.
- * @return -1 on failure, 0 on success.
+ * @brief Draw the message bar: the prompt, if it's up, or else the status
+ *        message, if it's recent enough.
+ * @param ab Appendable buffer to draw to.
  */
-int getCursorPosition(int *rows, int *cols) {
-  char buf[32];
-  unsigned int i = 0;
+void editorDrawMessageBar(struct abuf *ab) {
+  char prompt[KILO_PROMPT_MAX + 80];
+  const char *msg = E.statusmsg;
 
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
-  
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-    if (buf[i] == 'R') break;
-    i++;
+  if (E.prompt.active) {
+    snprintf(prompt, sizeof(prompt), E.prompt.fmt, E.prompt.buf);
+    msg = prompt;
+  } else if (editorNow() - E.statusmsg_time >= KILO_MSG_TIMEOUT) {
+#ifdef KILO_STATS
+    // Nothing else to show, so show how long frames are taking.
+    editorStatsOverlay(prompt, sizeof(prompt));
+    msg = prompt;
+#else
+    return;
+#endif
   }
-  buf[i] = '\0';
-  
-  if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
 
-  return 0;
+  int len = strlen(msg);
+  if (len > E.screencols) len = E.screencols;
+  abAppend(ab, msg, len);
 }
 
 /**
- * @brief Get current window size in rows and columns.
- * @param rows Pointer to the number of rows
- * @param cols Pointer to the number of columns
- * @return -1 if failed (rows & cols will not be set), 0 if success (rows & cols
- *         will be set)
+ * @brief Timer that makes sure the status message gets cleared once it's old.
  */
-int getWindowSize(int *rows, int *cols) {
-  struct winsize ws;
+void editorStatusTimeout() {
+  long long left = E.statusmsg_time + KILO_MSG_TIMEOUT - editorNow();
 
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-    return getCursorPosition(rows, cols);
+  if (left > 0) {
+    editorAddTimer(left, editorStatusTimeout);
   } else {
-   *cols = ws.ws_col;
-   *rows = ws.ws_row;
-   return 0;
+    E.statustimer = 0;
   }
 }
 
-/*** ROW OPERATIONS ***/
+/**
+ * @brief Set the status message, which is shown in the message bar for a few
+ *        seconds.
+ * @param fmt printf() style format string.
+ */
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+
+  E.statusmsg_time = editorNow();
+
+  if (!E.statustimer) {
+    E.statustimer = editorAddTimer(KILO_MSG_TIMEOUT, editorStatusTimeout) == 0;
+  }
+}
+
+/**
+ * @brief Draw a column of tildes along the left hand side of the screen, and
+ *        the document's rows. Only the rows that differ from what E.frame says
+ *        is on screen are drawn.
+ * @param ab Appendable buffer to draw to.
+ */
+void editorDrawRows(struct abuf *ab) {
+  struct screenFrame *f = &E.frame;
+  struct abuf *line = &E.line;
+  int last = -2;
+  int i;
+
+  for (i = 0; i < f->nrows; i++) {
+    abReset(line);
+    if (i < E.screenrows) {
+      editorDrawRow(line, i);
+    } else if (i == E.screenrows) {
+      editorDrawStatusBar(line);
+    } else {
+      editorDrawMessageBar(line);
+    }
+
+    struct abuf *shown = &f->rows[i];
+    if (
+      f->valid &&
+      line->len == shown->len &&
+      (line->len == 0 || memcmp(line->b, shown->b, line->len) == 0)
+    ) {
+      continue;
+    }
+
+    // Move to the start of the row. If the row above was just drawn, the
+    // cursor's already at the end of it, and \r\n is shorter than an absolute
+    // move.
+    if (i == last + 1) {
+      abAppend(ab, "\r\n", 2);
+    } else {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "\x1b[%d;1H", i + 1);
+      abAppend(ab, buf, strlen(buf));
+    }
+
+    abAppend(ab, line->b, line->len);
+
+    // Clear the row to the right of the cursor.
+    abAppend(ab, "\x1b[K", 3);
+
+    abReset(shown);
+    abAppend(shown, line->b, line->len);
+    last = i;
+  }
+
+  f->valid = 1;
+}
+
+/**
+ * @brief Refresh (re-render) the screen.
+ */
+void editorRefreshScreen() {
+  // All write() operations will be stored in this buffer, to be drawn at the
+  // end of this function.
+  struct abuf *ab = &E.ab;
+  abReset(ab);
+
+  editorScroll();
+  editorPrefetch();
+
+  // Hide the cursor (in supported terminals).
+  abAppend(ab, "\x1b[?25l", 6);
+
+  STATS(long long t = editorStatsNow());
+  editorDrawRows(ab);
+  STATS(E.stats.cur[STAT_DRAW] = editorStatsNow() - t);
+
+  // If no rows changed, there's no need to hide the cursor at all, and if the
+  // cursor didn't move either, there's nothing to send.
+  int cx = E.rx - E.coloff;
+  int cy = E.cy - E.rowoff;
+
+  // While the prompt's up, the cursor goes at the end of it.
+  if (E.prompt.active) {
+    cy = E.screenrows + 1;
+    cx = snprintf(NULL, 0, E.prompt.fmt, E.prompt.buf);
+    if (cx > E.screencols - 1) cx = E.screencols - 1;
+  }
+  int drawn = ab->len > 6;
+  if (!drawn) {
+    abReset(ab);
+    if (cx == E.frame.cx && cy == E.frame.cy) {
+      STATS(editorStatsFrame(0));
+      return;
+    }
+  }
+
+  // Move cursor to where it is in the document, relative to the screen.
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+  abAppend(ab, buf, strlen(buf));
+  E.frame.cx = cx;
+  E.frame.cy = cy;
+
+  // Reshow the cursor (again, in supported terminals).
+  if (drawn) abAppend(ab, "\x1b[?25h", 6);
+
+  // Write the draw buffer to stdout. It's kept around for the next frame.
+  STATS(t = editorStatsNow());
+  write(STDOUT_FILENO, ab->b, ab->len);
+  STATS(E.stats.cur[STAT_WRITE] = editorStatsNow() - t);
+  STATS(E.stats.cur[STAT_BYTES] = ab->len);
+  STATS(editorStatsFrame(1));
+}
+
+/*** SEARCH ***/
+
+/**
+ * @brief Record a match in E.search, and move the cursor to it if it's the
+ *        first one.
+ * @param row The row the match is in.
+ * @param col Where in the row's text it starts.
+ */
+void editorSearchAddMatch(int row, int col) {
+  struct editorSearch *s = &E.search;
+
+  if (s->nmatches == s->cap) {
+    int cap = s->cap ? s->cap * 2 : 64;
+    struct searchMatch *m = realloc(s->matches, sizeof(*m) * cap);
+    if (m == NULL) die("realloc");
+    s->matches = m;
+    s->cap = cap;
+  }
+
+  s->matches[s->nmatches].row = row;
+  s->matches[s->nmatches].col = col;
+  s->nmatches++;
+
+  if (s->current == -1) {
+    s->current = 0;
+    E.cy = row;
+    E.cx = col;
+  }
+}
+
+/**
+ * @brief Get the number of matches that can be visited: all of them, unless
+ *        the old ones are still being narrowed down.
+ * @return The number of matches.
+ */
+int editorSearchFound() {
+  struct editorSearch *s = &E.search;
+  return s->narrow != -1 ? s->kept : s->nmatches;
+}
+
+/**
+ * @brief Scan a run of rows that haven't been materialized yet for the query,
+ *        straight out of E.map, in one go.
+ * @param from First row of the run.
+ * @param to One past the last row of the run.
+ */
+void editorSearchMapped(int from, int to) {
+  struct editorSearch *s = &E.search;
+  char *mapend = E.map + E.mapsize;
+  char *p = &E.map[*editorLine(from)];
+
+  // The run ends where its last row does.
+  char *last = &E.map[*editorLine(to - 1)];
+  char *end = E.scan->find(last, mapend - last, '\n');
+  if (end == NULL) end = mapend;
+
+  int row = from;
+  char *m;
+
+  while ((m = scanSearch(p, end - p, s->query, s->qlen)) != NULL) {
+    size_t off = m - E.map;
+
+    // Find the row the match is in. Unmaterialized rows' offsets only ever
+    // go up, since rows are never moved past each other.
+    int lo = row;
+    int hi = to - 1;
+    while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (*editorLine(mid) <= off) lo = mid; else hi = mid - 1;
+    }
+    row = lo;
+
+    // The match has to be inside the row itself, rather than run over the end
+    // of it (the query never has a newline in it) or be in the bytes of a row
+    // that's been deleted since.
+    char *start = &E.map[*editorLine(row)];
+    char *eol = E.scan->find(start, end - start, '\n');
+    if (eol == NULL) eol = end;
+    while (eol > start && eol[-1] == '\r') eol--;
+
+    if (m + s->qlen <= eol) editorSearchAddMatch(row, m - start);
+    p = m + 1;
+  }
+}
+
+/**
+ * @brief Scan a materialized row for the query.
+ * @param at Index of the row.
+ * @return The row's size, to count towards the slice.
+ */
+int editorSearchRow(int at) {
+  struct editorSearch *s = &E.search;
+  erow *row = editorRow(at);
+  char *text = editorRowText(row);
+  char *p = text;
+  char *m;
+
+  while ((m = scanSearch(p, &text[row->size] - p, s->query, s->qlen))) {
+    editorSearchAddMatch(at, m - text);
+    p = m + 1;
+  }
+
+  return row->size;
+}
 
 /**
- * @brief Append a row to E.row
- * @param s String to be appended
- * @param len Length in of the string to be appended.
+ * @brief Show how many matches a finished search found.
  */
-void editorAppendRow(char *s, size_t len) {
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-
-  int at = E.numrows;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  E.numrows++;
+void editorSearchReport() {
+  int n = E.search.nmatches;
+  editorSetStatusMessage("Search: %d match%s", n, n == 1 ? "" : "es");
 }
 
-/*** FILE I/O ***/
-
 /**
- * @brief Read the first line of a file into E.row
- * @param filename The file to read.
+ * @brief Check the next old matches against a query that's been narrowed
+ *        down, dropping the ones that don't match any more. The matches that
+ *        survive keep their order.
+ * @param budget Roughly how many bytes of rows to look at.
  */
-void editorOpen(char *filename) {
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+void editorSearchNarrow(size_t budget) {
+  struct editorSearch *s = &E.search;
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-        (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')
+  while (s->narrow < s->nmatches && budget > 0) {
+    struct searchMatch m = s->matches[s->narrow++];
+    int len;
+    char *text = editorLineText(m.row, &len);
+
+    if (
+      m.col + s->qlen <= len &&
+      memcmp(&text[m.col], s->query, s->qlen) == 0
     ) {
-      linelen--;
+      s->matches[s->kept++] = m;
+
+      if (s->current == -1) {
+        s->current = 0;
+        E.cy = m.row;
+        E.cx = m.col;
+      }
     }
 
-    editorAppendRow(line, linelen);
+    budget = (size_t) len + 1 < budget ? budget - len - 1 : 0;
   }
 
-  free(line);
-  fclose(fp);
-}
+  if (s->narrow < s->nmatches) return;
 
-/*** APPEND BUFFER ***/
+  s->nmatches = s->kept;
+  s->narrow = -1;
+  if (s->done) editorSearchReport();
+}
 
 /**
- * @brief Appendable buffer of chars (a.k.a. a dynamic string).
+ * @brief Idle task that narrows down the old matches, if the query's been
+ *        added to, and then scans the next slice of rows for the query. Runs
+ *        of rows that are still just offsets into E.map are scanned straight
+ *        out of it, several MiB at a time.
+ * @return 1 while there's more to do.
  */
-struct abuf {
-  /**
-   * @brief Pointer to the buffer in memory.
-   */
-  char *b;
+int editorSearchIdle() {
+  struct editorSearch *s = &E.search;
+  if (!s->active || s->qlen == 0) return 0;
 
-  /**
-   * @brief Length of the buffer.
-   */
-  int len;
-};
+  // Rows are only scanned once the old matches are narrowed down, so that new
+  // matches always go on the end of the checked ones.
+  if (s->narrow != -1) {
+    editorSearchNarrow(KILO_SEARCH_SLICE);
+    return 1;
+  }
 
-/**
- * @brief An empty abuf (appendable buffer).
- */
-#define ABUF_INIT { NULL, 0 }
+  if (s->done) return 0;
 
-/**
- * @brief Append a string of char's to an instance of abuf.
- * @param abuf A pointer to the appendable buffer.
- * @param s The string of char's to be appended.
- * @param len The length of the string to be appended.
- */
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+  size_t budget = KILO_SEARCH_SLICE;
 
-  if (new == NULL) return;
+  while (budget > 0) {
+    int limit = s->wrapped ? s->start : E.numrows;
 
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+    if (s->next >= limit) {
+      if (s->wrapped) {
+        s->done = 1;
+        break;
+      }
+
+      // Rows still to be indexed are searched once they are. The indexer adds
+      // this task back when there are more.
+      if (E.indexpos != NULL) {
+        if (E.pool != NULL) return 0;
+        editorIndexMore(KILO_INDEX_SLICE);
+        continue;
+      }
+
+      s->wrapped = 1;
+      s->next = 0;
+      continue;
+    }
+
+    int at = s->next;
+
+    if (*editorLine(at) & KILO_LINE_LOADED) {
+      size_t n = editorSearchRow(at) + 1;
+      budget = n < budget ? budget - n : 0;
+      s->next++;
+      continue;
+    }
+
+    // Take as many unmaterialized rows as fit in what's left of the slice.
+    uint64_t base = *editorLine(at);
+    int to = at + 1;
+    while (
+      to < limit &&
+      !(*editorLine(to) & KILO_LINE_LOADED) &&
+      *editorLine(to) - base < budget
+    ) {
+      to++;
+    }
+
+    editorSearchMapped(at, to);
+    budget = 0;
+    s->next = to;
+  }
+
+  if (s->done) editorSearchReport();
+  return !s->done;
 }
 
 /**
- * @brief Free an appendable buffer from memory.
+ * @brief Start searching for a new query. If it's just the old one with more
+ *        on the end, the old matches are narrowed down by editorSearchIdle()
+ *        rather than searching everything again, and the scan carries on from
+ *        where it got to.
+ * @param query The new query.
  */
-void abFree(struct abuf *ab) {
-  free(ab->b);
-}
+void editorSearchSet(const char *query) {
+  struct editorSearch *s = &E.search;
+  int qlen = strlen(query);
 
-/*** OUTPUT ***/
+  if (s->qlen > 0 && qlen >= s->qlen && memcmp(query, s->query, s->qlen) == 0) {
+    // If the last narrowing's not finished, the matches it's kept and the ones
+    // it hasn't got to yet all need checking again.
+    if (s->narrow != -1) {
+      memmove(
+        &s->matches[s->kept],
+        &s->matches[s->narrow],
+        sizeof(*s->matches) * (s->nmatches - s->narrow)
+      );
+      s->nmatches -= s->narrow - s->kept;
+    }
 
-/**
- * @brief Draw a column of tildes along the left hand side of the screen.
- * @param abuf Appendable buffer to draw to.
- */
-void editorDrawRows(struct abuf *ab) {
-  int i;
+    s->narrow = 0;
+    s->kept = 0;
+  } else {
+    s->nmatches = 0;
+    s->narrow = -1;
+    s->next = s->start;
+    s->wrapped = 0;
+    s->done = 0;
+  }
 
-  for (i = 0; i < E.screenrows; i++) {
-    if (i >= E.numrows) {
-      // Draw tildes all the way down, as well as a welcome message 1/3 of the way
-      // down (if there's no file being opened).
-      if (E.numrows == 0 && i == E.screenrows / 3) {
-        char welcome[80];
-
-        int welcomelen = snprintf(
-          welcome,
-          sizeof(welcome),
-          "Kilo editor -- version %s",
-          KILO_VERSION
-        );
-
-        if (welcomelen > E.screencols) welcomelen = E.screencols;
-
-        // Center the greeting.
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
+  memcpy(s->query, query, qlen);
+  s->qlen = qlen;
+  s->current = -1;
 
-        while (padding--) {
-          abAppend(ab, " ", 1);
-        }
+  // Go back to where the search started, and then on to the first match once
+  // there is one.
+  E.statusmsg[0] = '\0';
+  E.cx = s->savedcx;
+  E.cy = s->savedcy;
 
-        abAppend(ab, welcome, welcomelen);
-      } else {
-        abAppend(ab, "~", 1);
-      }
-    } else {
-      int len = E.row[i].size;
-      if (len > E.screencols) len = E.screencols;
-      abAppend(ab, E.row[i].chars, len);
+  if (qlen > 0) editorAddIdle(editorSearchIdle);
+}
+
+/**
+ * @brief Called by the prompt after every key while searching.
+ * @param query What's been typed.
+ * @param key The key.
+ */
+void editorSearchCallback(char *query, int key) {
+  struct editorSearch *s = &E.search;
+
+  if (key == '\r' || key == '\x1b') {
+    if (key == '\x1b') {
+      E.cx = s->savedcx;
+      E.cy = s->savedcy;
+      E.rowoff = s->savedrowoff;
+      E.coloff = s->savedcoloff;
     }
 
-    // Clear the row to the right of the cursor.
-    abAppend(ab, "\x1b[K", 3);
+    s->active = 0;
+    return;
+  }
 
-    // Write \r\n on every line *except* the last one (to prevent the terminal
-    // from scrolling & hiding the topmost tilde).
-    if (i < E.screenrows - 1) {
-      abAppend(ab, "\r\n", 2);
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    // The matches are in the order they're visited, so the next one's just
+    // the next one along, once it's been found.
+    if (s->current != -1 && s->current + 1 < editorSearchFound()) {
+      s->current++;
+    } else if (s->done && s->narrow == -1 && s->nmatches > 0) {
+      s->current = 0;
+    }
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    if (s->current > 0) {
+      s->current--;
+    } else if (s->done && s->narrow == -1 && s->nmatches > 0) {
+      s->current = s->nmatches - 1;
     }
+  } else {
+    editorSearchSet(query);
+    return;
+  }
+
+  if (s->current != -1) {
+    E.cy = s->matches[s->current].row;
+    E.cx = s->matches[s->current].col;
   }
 }
 
 /**
- * @brief Refresh (re-render) the screen.
+ * @brief Start an incremental search from the cursor.
  */
-void editorRefreshScreen() {
-  // All write() operations will be stored in this buffer, to be drawn at the
-  // end of this function.
-  struct abuf ab = ABUF_INIT;
+void editorFind() {
+  struct editorSearch *s = &E.search;
 
-  // Hide the cursor (in supported terminals).
-  abAppend(&ab, "\x1b[?25l", 6);
+  s->active = 1;
+  s->qlen = 0;
+  s->nmatches = 0;
+  s->current = -1;
+  s->narrow = -1;
+  s->start = E.cy < E.numrows ? E.cy : 0;
+  s->next = s->start;
+  s->wrapped = 0;
+  s->done = 0;
+  s->savedcx = E.cx;
+  s->savedcy = E.cy;
+  s->savedrowoff = E.rowoff;
+  s->savedcoloff = E.coloff;
 
-  // Position the cursor at the top left
-  abAppend(&ab, "\x1b[H", 3);
+  editorPromptStart("Search: %s (Use ESC/Arrows/Enter)", editorSearchCallback);
+}
 
-  editorDrawRows(&ab);
+/*** INPUT ***/
 
-  // Move cursor to position set in the global editor state.
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, E.cx + 1);
-  abAppend(&ab, buf, strlen(buf));
+/**
+ * @brief Open a prompt in the message bar. Keys go to it until Enter or Escape
+ *        is pressed.
+ * @param fmt printf() format for the prompt, with a %s for what's typed.
+ * @param callback Called after every key; see editorPromptState.callback.
+ */
+void editorPromptStart(const char *fmt, void (*callback)(char *, int)) {
+  E.prompt.active = 1;
+  E.prompt.fmt = fmt;
+  E.prompt.buf[0] = '\0';
+  E.prompt.len = 0;
+  E.prompt.callback = callback;
+}
 
-  // Reshow the cursor (again, in supported terminals).
-  abAppend(&ab, "\x1b[?25h", 6);
+/**
+ * @brief Handle a key while the prompt's up.
+ * @param c The key.
+ */
+void editorPromptKey(int c) {
+  struct editorPromptState *p = &E.prompt;
 
-  // Write the draw buffer to stdout, and free it from memory.
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
-}
+  if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+    if (p->len != 0) p->buf[--p->len] = '\0';
+  } else if (c == '\x1b' || c == '\r') {
+    p->active = 0;
+  } else if (!iscntrl(c) && c < 128) {
+    if (p->len < KILO_PROMPT_MAX - 1) {
+      p->buf[p->len++] = c;
+      p->buf[p->len] = '\0';
+    }
+  }
 
-/*** INPUT ***/
+  if (p->callback) p->callback(p->buf, c);
+}
 
 /**
  * @brief Increment or decrement either E.cx or E.cy, based on the char passed.
- * @param key The key pressed. Is mapped ARROW_UP, ARROW_DOWN, ARROW_LEFT, and
- *            ARROW_RIGHT.
+ * @param key The key pressed. Is mapped ARROW_UP, ARROW_DOWN, ARROW_LEFT,
+ *            ARROW_RIGHT, PAGE_UP and PAGE_DOWN.
  */
 void editorMoveCursor(int key) {
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
+
   switch (key) {
     case ARROW_LEFT:
       if (E.cx != 0) {
@@ -467,7 +5427,7 @@ void editorMoveCursor(int key) {
       break;
 
     case ARROW_RIGHT:
-      if (E.cx != E.screencols - 1) {
+      if (row && E.cx < row->size) {
         E.cx++;
       }
       break;
@@ -479,11 +5439,25 @@ void editorMoveCursor(int key) {
       break;
 
     case ARROW_DOWN:
-      if (E.cy != E.screenrows - 1) {
+      if (E.cy < E.numrows) {
         E.cy++;
       }
       break;
+
+    // Only the rows that end up on screen are touched, however far this jumps.
+    case PAGE_UP:
+      E.cy = E.cy > E.screenrows ? E.cy - E.screenrows : 0;
+      break;
+
+    case PAGE_DOWN:
+      E.cy = E.cy + E.screenrows < E.numrows ? E.cy + E.screenrows : E.numrows;
+      break;
   }
+
+  // Snap the cursor to the end of the row it ended up on.
+  row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen) E.cx = rowlen;
 }
 
 /**
@@ -492,9 +5466,26 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
   int c = editorReadKey();
 
+  if (E.prompt.active) {
+    editorPromptKey(c);
+    return;
+  }
+
+  // Anything the key could move the cursor to or edit has to be indexed first,
+  // or new rows could end up in between the ones still to be indexed.
+  editorIndexUntil(E.cy + E.screenrows + 1);
+
   switch (c) {
+    // <Enter>
+    case '\r':
+      editorInsertNewline();
+      break;
+
     // Quit
     case CTRL_KEY('q'):
+      editorFreeRows();
+      STATS(editorStatsDump());
+
       // Clear the screen
       write(STDOUT_FILENO, "\x1b[2J", 4);
 
@@ -504,6 +5495,25 @@ void editorProcessKeypress() {
       exit(0);
       break;
 
+    // Save
+    case CTRL_KEY('s'):
+      editorSave();
+      break;
+
+    // Find
+    case CTRL_KEY('f'):
+      editorFind();
+      break;
+
+    // Undo & redo
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
     // <Home>
     case HOME_KEY:
       E.cx = 0;
@@ -511,44 +5521,410 @@ void editorProcessKeypress() {
 
     // <End>
     case END_KEY:
-      E.cx = E.screencols - 1;
+      if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size;
       break;
 
-    // <Page Up> & <Page Down>
-    case PAGE_UP:
-    case PAGE_DOWN:
-      {
-        int times = E.screenrows;
-        while (times--) {
-          editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    // <Backspace> & <Delete>
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DEL_KEY:
+      if (c == DEL_KEY && E.cy < E.numrows) {
+        // Delete the char under the cursor by backspacing from just after it.
+        // At the end of a row, that means from the start of the next one.
+        if (E.cx < editorRow(E.cy)->size) {
+          E.cx++;
+        } else if (E.cy + 1 < E.numrows) {
+          E.cy++;
+          E.cx = 0;
+        } else {
+          break;
         }
       }
+      editorDelChar();
       break;
 
     // Cursor movement
+    case PAGE_UP:
+    case PAGE_DOWN:
     case ARROW_UP:
     case ARROW_DOWN:
     case ARROW_LEFT:
     case ARROW_RIGHT:
       editorMoveCursor(c);
       break;
+
+    // Ignore <Escape> & any other control keys that aren't bound to anything.
+    case CTRL_KEY('l'):
+    case '\x1b':
+      break;
+
+    default:
+      editorInsertChar(c);
+      break;
+  }
+}
+
+/*** EVENT LOOP ***/
+
+/**
+ * @brief Get the time from a clock that never jumps around.
+ * @return Milliseconds since some arbitrary point in the past.
+ */
+long long editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Have the event loop call a function after a delay.
+ * @param ms How long to wait, in ms.
+ * @param fn The function to call. It may add timers of its own.
+ * @return 0 on success, or -1 if there are too many timers pending.
+ */
+int editorAddTimer(int ms, void (*fn)(void)) {
+  struct eventLoop *l = &E.loop;
+  if (l->ntimers == KILO_MAX_TIMERS) return -1;
+
+  l->timers[l->ntimers].when = editorNow() + ms;
+  l->timers[l->ntimers].fn = fn;
+  l->ntimers++;
+  return 0;
+}
+
+/**
+ * @brief Queue an idle task, which the event loop runs in slices whenever it's
+ *        got no input to handle. Adding a task that's already queued does
+ *        nothing.
+ * @param fn The task. See eventLoop.idle.
+ * @return 0 on success, or -1 if there are too many idle tasks queued.
+ */
+int editorAddIdle(int (*fn)(void)) {
+  struct eventLoop *l = &E.loop;
+  int i;
+
+  for (i = 0; i < l->nidle; i++) {
+    if (l->idle[i] == fn) return 0;
+  }
+
+  if (l->nidle == KILO_MAX_IDLE) return -1;
+  l->idle[l->nidle++] = fn;
+  return 0;
+}
+
+/**
+ * @brief Have the event loop call a function whenever a file descriptor is
+ *        readable (e.g. a pipe that a background thread reports back through).
+ * @param fd The file descriptor.
+ * @param fn The function to call.
+ * @return 0 on success, or -1 if there are too many fds watched.
+ */
+int editorWatchFd(int fd, void (*fn)(int fd)) {
+  struct eventLoop *l = &E.loop;
+  if (l->nwatches == KILO_MAX_WATCHES) return -1;
+
+  l->watches[l->nwatches].fd = fd;
+  l->watches[l->nwatches].fn = fn;
+  l->nwatches++;
+  return 0;
+}
+
+/**
+ * @brief Stop watching a file descriptor added with editorWatchFd().
+ * @param fd The file descriptor.
+ */
+void editorUnwatchFd(int fd) {
+  struct eventLoop *l = &E.loop;
+  int i;
+
+  for (i = 0; i < l->nwatches; i++) {
+    if (l->watches[i].fd == fd) {
+      l->watches[i] = l->watches[--l->nwatches];
+      return;
+    }
+  }
+}
+
+/**
+ * @brief SIGWINCH handler. Just flags the resize and wakes the event loop up;
+ *        the actual work happens in editorHandleResize().
+ */
+void editorSigwinch(int sig) {
+  (void) sig;
+
+  int saved = errno;
+  E.loop.winch = 1;
+  write(E.loop.sigpipe[1], "", 1);
+  errno = saved;
+}
+
+/**
+ * @brief Adjust to a new window size, after a SIGWINCH.
+ */
+void editorHandleResize() {
+  int rows, cols;
+
+  // A terminal that getWindowSize() doesn't work for can't say how big it is
+  // now without another round trip, so stick with the size it was.
+  if (getWindowSize(&rows, &cols) == -1) return;
+  editorSetWindowSize(rows, cols);
+
+  editorFrameResize();
+
+  // The next redraw scrolls the cursor back onto the screen if need be.
+  E.prefetchoff = -1;
+}
+
+/**
+ * @brief Set up the event loop's self-pipe & signal handlers.
+ */
+void editorInitLoop() {
+  struct eventLoop *l = &E.loop;
+
+  l->ntimers = 0;
+  l->nidle = 0;
+  l->nwatches = 0;
+  l->winch = 0;
+
+  if (pipe(l->sigpipe) == -1) die("pipe");
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(l->sigpipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(l->sigpipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorSigwinch;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+/**
+ * @brief Run any timers that are due.
+ * @return How long (in ms) until the next timer is due, or -1 if there aren't
+ *         any timers left.
+ */
+int editorRunTimers() {
+  struct eventLoop *l = &E.loop;
+  long long now = editorNow();
+  long long next = -1;
+  int i = 0;
+
+  while (i < l->ntimers) {
+    if (l->timers[i].when <= now) {
+      void (*fn)(void) = l->timers[i].fn;
+      l->timers[i] = l->timers[--l->ntimers];
+      fn();
+      // Start over, since fn() may have added timers.
+      i = 0;
+      next = -1;
+      continue;
+    }
+
+    long long left = l->timers[i].when - now;
+    if (next == -1 || left < next) next = left;
+    i++;
+  }
+
+  return next > INT_MAX ? INT_MAX : (int) next;
+}
+
+/**
+ * @brief Run one slice of every queued idle task.
+ */
+void editorRunIdle() {
+  struct eventLoop *l = &E.loop;
+  int i = 0;
+
+  while (i < l->nidle) {
+    if (l->idle[i]()) {
+      i++;
+    } else {
+      // Keep the remaining tasks in order.
+      memmove(
+        &l->idle[i],
+        &l->idle[i + 1],
+        sizeof(l->idle[0]) * (l->nidle - 1 - i)
+      );
+      l->nidle--;
+    }
+  }
+}
+
+/**
+ * @brief The editor's main loop. Redraws the screen, then sleeps until there's
+ *        something to do. Never returns.
+ */
+void editorRun() {
+  struct eventLoop *l = &E.loop;
+  struct pollfd pfds[2 + KILO_MAX_WATCHES];
+
+  while (1) {
+    editorRefreshScreen();
+
+    int timeout = editorRunTimers();
+    if (l->nidle > 0) timeout = 0;
+
+    int nfds = 0;
+    pfds[nfds++] = (struct pollfd) { STDIN_FILENO, POLLIN, 0 };
+    pfds[nfds++] = (struct pollfd) { l->sigpipe[0], POLLIN, 0 };
+
+    int i;
+    for (i = 0; i < l->nwatches; i++) {
+      pfds[nfds++] = (struct pollfd) { l->watches[i].fd, POLLIN, 0 };
+    }
+
+    if (poll(pfds, nfds, timeout) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(l->sigpipe[0], drain, sizeof(drain)) > 0);
+    }
+
+    if (l->winch) {
+      l->winch = 0;
+      editorHandleResize();
+    }
+
+    // Watched fds may be unwatched by their handlers, so work from the copies
+    // in pfds rather than from l->watches.
+    for (i = 2; i < nfds; i++) {
+      if (pfds[i].revents == 0) continue;
+
+      int j;
+      for (j = 0; j < l->nwatches; j++) {
+        if (l->watches[j].fd == pfds[i].fd) {
+          l->watches[j].fn(pfds[i].fd);
+          break;
+        }
+      }
+    }
+
+    if (
+      (pfds[0].revents & (POLLHUP | POLLERR)) &&
+      E.input.len == 0 &&
+      editorFillInput() == 0
+    ) {
+      // The terminal's gone away (see editorInputWait()). poll() will keep
+      // saying so straight away, so carrying on would just spin.
+      errno = EIO;
+      die("read");
+    }
+
+    if (pfds[0].revents || E.input.len > 0) {
+      // Handle every key that's already arrived (e.g. a whole paste) before
+      // drawing the screen again.
+      while (editorInputPending()) {
+        STATS(long long t = editorStatsNow());
+        editorProcessKeypress();
+        STATS(E.stats.cur[STAT_KEYS] += editorStatsNow() - t);
+        STATS(E.stats.keys = 1);
+      }
+    } else if (l->nidle > 0) {
+      editorRunIdle();
+    }
   }
 }
 
 /*** INIT ***/
 
 /**
- * @brief Initialize various properties of the editor.
+ * @brief Initialize various properties of the editor, for a window of a given
+ *        size. E.input is left alone.
+ * @param rows Height of the window.
+ * @param cols Width of the window.
  */
-void initEditor() {
+void initEditorWithSize(int rows, int cols) {
   E.cx = 0;
   E.cy = 0;
+  E.rx = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.prefetchoff = -1;
   E.numrows = 0;
-  E.row = NULL;
+  E.lineoff.chunks = NULL;
+  E.lineoff.nchunks = 0;
+  E.lineoff.cap = 0;
+  E.lineoff.start = NULL;
+  E.lineoff.valid = 1;
+  E.lineoff.last = 0;
+  E.rowpool.blocks = NULL;
+  E.rowpool.nblocks = 0;
+  E.rowpool.used = 0;
+  E.rowpool.free = -1;
+  E.map = NULL;
+  E.mapsize = 0;
+  E.mapowned = 0;
+  E.indexpos = NULL;
+  E.pool = NULL;
+  E.filename = NULL;
+  E.crlf = 0;
+  E.dirty = 0;
+  E.save = NULL;
+  E.savepending = 0;
+  E.syntax = NULL;
+  E.hlvalid = 0;
+  E.hlbuf = (struct abuf) ABUF_INIT;
+  E.statusmsg[0] = '\0';
+  E.statusmsg_time = 0;
+  E.statustimer = 0;
+  E.prompt.active = 0;
+  E.search.active = 0;
+  E.search.matches = NULL;
+  E.search.cap = 0;
+  E.search.narrow = -1;
+  E.undo.arena = (struct arena) ARENA_INIT;
+  E.undo.recs = NULL;
+  E.undo.marks = NULL;
+  E.undo.nrecs = 0;
+  E.undo.cap = 0;
+  E.undo.cur = 0;
+  E.undo.open = 0;
+  E.undo.text = (struct abuf) ABUF_INIT;
+  E.undo.joinnext = 0;
+  E.arena = (struct arena) ARENA_INIT;
+  scanInit();
+
+  editorSetWindowSize(rows, cols);
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  editorInitLoop();
+
+  E.ab = (struct abuf) ABUF_INIT;
+  E.line = (struct abuf) ABUF_INIT;
+
+  E.frame.rows = NULL;
+  E.frame.nrows = 0;
+  E.frame.cx = -1;
+  E.frame.cy = -1;
+  editorFrameResize();
+}
+
+/**
+ * @brief Initialize the editor for the terminal it's running in.
+ */
+void initEditor() {
+  int rows, cols;
+
+  // The fallback reads the terminal's reply through E.input.
+  E.input.head = 0;
+  E.input.len = 0;
+
+  if (
+    getWindowSize(&rows, &cols) == -1 &&
+    getWindowSizeFallback(&rows, &cols) == -1
+  ) {
+    die("getWindowSize");
+  }
+
+  initEditorWithSize(rows, cols);
 }
 
+#ifndef KILO_NO_MAIN
 /**
  * @brief Main entry point.
  */
@@ -560,10 +5936,12 @@ int main(int argc, char *argv[]) {
     editorOpen(argv[1]);
   }
 
-  while (1) {
-    editorRefreshScreen();
-    editorProcessKeypress();
-  }
+  editorSetStatusMessage(
+    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo"
+  );
+
+  editorRun();
 
   return 0;
 }
+#endif
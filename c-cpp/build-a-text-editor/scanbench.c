@@ -0,0 +1,174 @@
+/**
+ * @file scanbench.c
+ * @brief Microbenchmark for the newline-scanning kernels in kilo.c. Compares
+ *        every kernel the CPU supports against the scalar fallback, both on
+ *        their own and as used by the file loader. The C library's memchr()
+ *        is measured too, for reference.
+ *
+ * Usage: ./scanbench [FILE]
+ *
+ * Without a FILE, a synthetic buffer of lines of random length (with some CRLF
+ * line endings thrown in) is used.
+ */
+
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+/** @brief Size of the synthetic buffer. */
+#define BENCH_SIZE (256 << 20)
+
+/** @brief How many times each measurement is repeated (the best is kept). */
+#define BENCH_RUNS 5
+
+/**
+ * @brief Get the time from a monotonic clock, in seconds.
+ */
+double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Count bytes with memchr(), for the reference row.
+ */
+size_t benchCountMemchr(const char *p, size_t n, int c) {
+  const char *end = p + n;
+  size_t count = 0;
+
+  while ((p = memchr(p, c, end - p)) != NULL) {
+    count++;
+    p++;
+  }
+
+  return count;
+}
+
+char *benchFindMemchr(const char *p, size_t n, int c) {
+  return memchr(p, c, n);
+}
+
+/** @brief memchr(), dressed up as a scanKernel. */
+const struct scanKernel benchMemchr = {
+  "memchr", scanAlwaysSupported, benchCountMemchr, benchFindMemchr
+};
+
+/**
+ * @brief Fill a buffer with lines of random length, every 8th ending in CRLF.
+ */
+void benchSynthesize(char *buf, size_t len) {
+  size_t i = 0;
+  unsigned int seed = 1;
+  int line = 0;
+
+  while (i < len) {
+    seed = seed * 1103515245 + 12345;
+    size_t n = (seed >> 16) % 160;
+
+    for (; n > 0 && i < len; n--, i++) buf[i] = 'a' + (i % 26);
+    if (line++ % 8 == 0 && i < len) buf[i++] = '\r';
+    if (i < len) buf[i++] = '\n';
+  }
+}
+
+/**
+ * @brief Split a buffer into lines the way editorAppendLines() does, without
+ *        storing any rows.
+ * @return Total length of the lines, so the work can't be optimized away.
+ */
+size_t benchSplit(const struct scanKernel *k, char *p, char *end) {
+  size_t total = 0;
+
+  while (p < end) {
+    char *nl = k->find(p, end - p, '\n');
+    if (nl == NULL) nl = end;
+
+    char *eol = nl;
+    while (eol > p && eol[-1] == '\r') eol--;
+
+    total += eol - p;
+    p = nl + 1;
+  }
+
+  return total;
+}
+
+int main(int argc, char *argv[]) {
+  char *buf;
+  size_t len;
+
+  if (argc >= 2) {
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      perror(argv[1]);
+      return 1;
+    }
+
+    len = st.st_size;
+    buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+    close(fd);
+  } else {
+    len = BENCH_SIZE;
+    buf = malloc(len);
+    if (buf == NULL) {
+      perror("malloc");
+      return 1;
+    }
+    benchSynthesize(buf, len);
+  }
+
+  double mb = len / (1024.0 * 1024.0);
+  printf("%.1f MiB buffer\n\n", mb);
+  printf("%-8s %12s %12s %12s\n", "kernel", "count MB/s", "split MB/s",
+      "load MB/s");
+
+  // The load column goes through the real line index, which has to be set up
+  // the way it is when kilo starts.
+  initEditorWithSize(24, 80);
+
+  // Every kernel, and then memchr() for reference.
+  size_t nkernels = sizeof(scanKernels) / sizeof(scanKernels[0]);
+  size_t expect = 0;
+  size_t j;
+
+  for (j = 0; j <= nkernels; j++) {
+    const struct scanKernel *k = j < nkernels ? &scanKernels[j] : &benchMemchr;
+    if (!k->supported()) continue;
+
+    double best[3] = { 1e9, 1e9, 1e9 };
+    size_t lines = 0;
+    int run;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+      double t = benchNow();
+      lines = k->count(buf, len, '\n');
+      t = benchNow() - t;
+      if (t < best[0]) best[0] = t;
+
+      t = benchNow();
+      volatile size_t total = benchSplit(k, buf, buf + len);
+      (void) total;
+      t = benchNow() - t;
+      if (t < best[1]) best[1] = t;
+
+      scanSelect(k);
+      t = benchNow();
+      editorOpenBuffer(buf, len);
+      t = benchNow() - t;
+      if (t < best[2]) best[2] = t;
+      editorFreeRows();
+    }
+
+    if (expect == 0) expect = lines;
+    printf("%-8s %12.1f %12.1f %12.1f%s\n", k->name, mb / best[0],
+        mb / best[1], mb / best[2], lines == expect ? "" : "  MISMATCH");
+  }
+
+  printf("\n%zu lines\n", expect);
+  return 0;
+}
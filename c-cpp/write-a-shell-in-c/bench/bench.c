@@ -0,0 +1,219 @@
+/***************************//**
+
+  @file   bench.c
+
+  @brief  Benchmarks for lsh: how fast it starts, launches commands, pipes
+          data and tokenizes input. Every experiment is run with each way of
+          launching (LSH_LAUNCH=spawn or fork) and with the command hash on and
+          off (LSH_HASH=1 or 0), and the best of a few runs is kept.
+
+  Usage: lsh-bench LSH [RUNS]
+
+******************************/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define BENCH_RUNS 3
+#define BENCH_STARTS 200
+#define BENCH_COMMANDS 2000
+#define BENCH_PIPE_MB 256
+#define BENCH_TOKEN_MB 32
+
+// Size of each line in the tokenizer's script.
+#define BENCH_TOKEN_LINE (1 << 20)
+
+/**
+ * @brief Get the time from a monotonic clock, in seconds.
+ */
+double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Run lsh on a script, with its output thrown away, and wait for it.
+ * @param lsh Path of lsh.
+ * @param script Path of the script.
+ * @return How long it took, in seconds.
+ */
+double bench_run(const char *lsh, const char *script) {
+  posix_spawn_file_actions_t actions;
+  char *argv[] = { (char *) lsh, (char *) script, NULL };
+  double start;
+  pid_t pid;
+  int status;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+      O_WRONLY, 0);
+
+  start = bench_now();
+  if (posix_spawn(&pid, lsh, &actions, NULL, argv, environ) != 0) {
+    perror("lsh-bench: spawn");
+    exit(EXIT_FAILURE);
+  }
+  waitpid(pid, &status, 0);
+  start = bench_now() - start;
+
+  posix_spawn_file_actions_destroy(&actions);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "lsh-bench: %s %s failed\n", lsh, script);
+    exit(EXIT_FAILURE);
+  }
+  return start;
+}
+
+/**
+ * @brief Write a script to a temporary file.
+ * @param path Template for mkstemp(), which gets the file's name.
+ * @param line A line to write.
+ * @param count How many times to write it.
+ */
+void bench_script(char *path, const char *line, long count) {
+  int fd = mkstemp(path);
+  FILE *f;
+  long i;
+
+  if (fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+    perror("lsh-bench: script");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < count; i++) {
+    fputs(line, f);
+  }
+  fclose(f);
+}
+
+/**
+ * @brief Make a line of words for the tokenizer to chew on: plain, quoted
+ *        and escaped ones, all for `cd .` to ignore (so that nothing is
+ *        launched and the time is all the shell's).
+ * @return The line (to be freed).
+ */
+char *bench_token_line(void) {
+  static const char *words[] = {
+    "plain", "'single quoted'", "\"double \\\"quoted\\\"\"", "es\\ caped",
+    "'a|b'", "x\\>\\>y"
+  };
+  size_t nwords = sizeof(words) / sizeof(words[0]);
+  char *line = malloc(BENCH_TOKEN_LINE + 64);
+  size_t len;
+  size_t i = 0;
+
+  if (line == NULL) {
+    perror("lsh-bench");
+    exit(EXIT_FAILURE);
+  }
+
+  len = sprintf(line, "cd .");
+  while (len < BENCH_TOKEN_LINE) {
+    len += sprintf(line + len, " %s", words[i++ % nwords]);
+  }
+  line[len++] = '\n';
+  line[len] = '\0';
+  return line;
+}
+
+/**
+ * @brief Run a script RUNS times.
+ * @return The fastest run, in seconds.
+ */
+double bench_best(const char *lsh, const char *script, int runs) {
+  double best = 1e9;
+  int i;
+
+  for (i = 0; i < runs; i++) {
+    double t = bench_run(lsh, script);
+    if (t < best) {
+      best = t;
+    }
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  static const char *launches[] = { "spawn", "fork" };
+  static const char *hashes[] = { "1", "0" };
+  char empty[] = "/tmp/lsh-bench-XXXXXX";
+  char commands[] = "/tmp/lsh-bench-XXXXXX";
+  char pipeline[] = "/tmp/lsh-bench-XXXXXX";
+  char tokens[] = "/tmp/lsh-bench-XXXXXX";
+  char pipeline_line[128];
+  char *token_line;
+  const char *lsh;
+  int runs = BENCH_RUNS;
+  int l, h, i;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s LSH [RUNS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  lsh = argv[1];
+  if (argc > 2) {
+    runs = atoi(argv[2]) > 0 ? atoi(argv[2]) : 1;
+  }
+
+  snprintf(pipeline_line, sizeof(pipeline_line),
+      "head -c %dM /dev/zero | cat | cat > /dev/null\n", BENCH_PIPE_MB);
+  token_line = bench_token_line();
+
+  bench_script(empty, "", 0);
+  bench_script(commands, "true\n", BENCH_COMMANDS);
+  bench_script(pipeline, pipeline_line, 1);
+  bench_script(tokens, token_line,
+      (long) BENCH_TOKEN_MB * (1 << 20) / strlen(token_line));
+
+  printf("%-6s %-5s %14s %14s %14s %14s\n", "launch", "hash", "startup/s",
+      "commands/s", "pipe MB/s", "tokens MB/s");
+
+  for (l = 0; l < 2; l++) {
+    for (h = 0; h < 2; h++) {
+      double best = 1e9;
+
+      setenv("LSH_LAUNCH", launches[l], 1);
+      setenv("LSH_HASH", hashes[h], 1);
+
+      // Startup: many runs of an empty script, timed together.
+      for (i = 0; i < runs; i++) {
+        double t = bench_now();
+        int n;
+
+        for (n = 0; n < BENCH_STARTS; n++) {
+          bench_run(lsh, empty);
+        }
+        t = bench_now() - t;
+        if (t < best) {
+          best = t;
+        }
+      }
+
+      printf("%-6s %-5s %14.0f %14.0f %14.1f %14.1f\n", launches[l],
+          h == 0 ? "on" : "off", BENCH_STARTS / best,
+          BENCH_COMMANDS / bench_best(lsh, commands, runs),
+          BENCH_PIPE_MB / bench_best(lsh, pipeline, runs),
+          BENCH_TOKEN_MB / bench_best(lsh, tokens, runs));
+      fflush(stdout);
+    }
+  }
+
+  unlink(empty);
+  unlink(commands);
+  unlink(pipeline);
+  unlink(tokens);
+  free(token_line);
+  return EXIT_SUCCESS;
+}
@@ -10,12 +10,27 @@
 
 ******************************/
 
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
+
+extern char **environ;
 
 /*
  * Function declarations for builtin commands:
@@ -23,24 +38,89 @@
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
+int lsh_hash(char **args);
+int lsh_jobs(char **args);
+int lsh_fg(char **args);
+int lsh_bg(char **args);
+int lsh_wait(char **args);
+int lsh_parallel(char **args);
+int lsh_time(char **args);
 
 /*
- * List of builtin commands, followed by their corrosponding functions.
+ * List of builtin commands and their corrosponding functions, sorted by name
+ * (in strcmp() order), so that they can be found with a binary search.
  */
-char *builtin_str[] = {
-  "cd",
-  "help",
-  "exit"
+struct lsh_builtin {
+  const char *name;
+  int (*func) (char **);
 };
 
-int (*builtin_func[]) (char **) = {
-  &lsh_cd,
-  &lsh_help,
-  &lsh_exit
+struct lsh_builtin lsh_builtins[] = {
+  { "bg", &lsh_bg },
+  { "cd", &lsh_cd },
+  { "exit", &lsh_exit },
+  { "fg", &lsh_fg },
+  { "hash", &lsh_hash },
+  { "help", &lsh_help },
+  { "jobs", &lsh_jobs },
+  { "parallel", &lsh_parallel },
+  { "time", &lsh_time },
+  { "wait", &lsh_wait }
 };
 
 int lsh_num_builtins() {
-  return sizeof(builtin_str) / sizeof(char *);
+  return sizeof(lsh_builtins) / sizeof(struct lsh_builtin);
+}
+
+// Names longer than this all share the last bit of a length mask.
+#define LSH_BUILTIN_MAXLEN 31
+
+// For each first byte, a bit for each length of builtin name that starts with
+// it. Most commands aren't builtins, and this turns them away without a single
+// strcmp().
+unsigned int lsh_builtin_lengths[256];
+
+/**
+ * @brief Set up the table that builtin lookups are filtered through.
+ */
+void lsh_builtins_init(void) {
+  int i;
+
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    const char *name = lsh_builtins[i].name;
+    size_t len = strnlen(name, LSH_BUILTIN_MAXLEN);
+
+    assert(i == 0 || strcmp(lsh_builtins[i - 1].name, name) < 0);
+    lsh_builtin_lengths[(unsigned char) name[0]] |= 1u << len;
+  }
+}
+
+/**
+ * @brief Find a builtin command.
+ * @param name Name of the command.
+ * @return The builtin, or NULL if there isn't one by that name.
+ */
+struct lsh_builtin *lsh_find_builtin(const char *name) {
+  size_t len = strnlen(name, LSH_BUILTIN_MAXLEN);
+  int lo = 0, hi = lsh_num_builtins() - 1;
+
+  if (!(lsh_builtin_lengths[(unsigned char) name[0]] & (1u << len))) {
+    return NULL;
+  }
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp(name, lsh_builtins[mid].name);
+
+    if (cmp == 0) {
+      return &lsh_builtins[mid];
+    } else if (cmp < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
 }
 
 /*
@@ -76,7 +156,7 @@ int lsh_help(char **args) {
   printf("The following are built in:\n\n");
 
   for (i = 0; i < lsh_num_builtins(); i++) {
-    printf("  %s\n", builtin_str[i]);
+    printf("  %s\n", lsh_builtins[i].name);
   }
 
   printf("\nUse the man command for information on other programs.\n");
@@ -92,187 +172,2245 @@ int lsh_exit(char **args) {
   return 0;
 }
 
-/**
- * @brief Launch a program and wait for it to terminate.
- * @param args NULL-terminated list of arguments (including program)
- * @return Always returns 1, to continue execution.
+/*
+ * Command hash: where in the PATH each command was last found.
  */
-int lsh_launch(char **args) {
-  pid_t pid;
-  pid_t wpid;
 
-  int status;
-  
-  // Duplicate this process.
-  pid = fork();
+#define LSH_HASH_BUCKETS 256
+#define LSH_DEFAULT_PATH "/bin:/usr/bin"
 
-  if (pid == 0) {
-    // This is the child process! Replace it with args[0].
-    if (execvp(args[0], args) == -1) {
-      perror("lsh");
-    }
+struct lsh_hash_entry {
+  char *name;
+  char *path;
+  int hits;
+  struct lsh_hash_entry *next;
+};
+
+struct lsh_hash_entry *lsh_hash_table[LSH_HASH_BUCKETS];
+
+// The PATH the entries in the table were found with.
+char *lsh_hash_path;
+
+// The last command found in a relative directory of the PATH (like "." or an
+// empty entry). Those aren't hashed, since they depend on the current
+// directory: this only keeps the path alive until the next lookup.
+char *lsh_hash_relative;
+
+/**
+ * @brief Allocate memory, or exit if there is none.
+ * @param size Number of bytes.
+ * @return The memory.
+ */
+void *lsh_malloc(size_t size) {
+  void *p = malloc(size);
+
+  if (!p) {
+    fprintf(stderr, "lsh: allocation error\n");
     exit(EXIT_FAILURE);
-  } else if (pid < 0) {
-    // Error forking.
-    perror("lsh");
-  } else {
-    // This is the parent process!
-    do {
-      wpid = waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
   }
+  return p;
+}
 
-  return 1;
+/**
+ * @brief Copy a string, or exit if there is no memory for it.
+ * @param str The string.
+ * @return The copy.
+ */
+char *lsh_strdup(const char *str) {
+  size_t len = strlen(str) + 1;
+  return memcpy(lsh_malloc(len), str, len);
 }
 
 /**
- * @brief Execute shell built-in or launch program.
- * @param args NULL-terminated list of arguments.
- * @return 1 if the shell should continue running, or 0 if it should terminate.
+ * @brief Hash a command name (FNV-1a).
+ * @param name The name.
+ * @return Index of its bucket in the command hash.
  */
-int lsh_execute(char **args) {
-  int i;
+unsigned int lsh_hash_bucket(const char *name) {
+  unsigned int h = 2166136261u;
 
-  if (args[0] == NULL) {
-    // An empty command was entered, so do nothing and let the shell
-    // continue executing.
-    return 1;
+  for (; *name; name++) {
+    h = (h ^ (unsigned char) *name) * 16777619u;
   }
+  return h % LSH_HASH_BUCKETS;
+}
 
-  // Search through the list of shell builtins.
-  // If args[0] is in the list, execute the corrosponding function, and return
-  // the result.
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return (*builtin_func[i])(args);
+/**
+ * @brief Forget every command in the hash.
+ */
+void lsh_hash_clear(void) {
+  struct lsh_hash_entry *e, *next;
+  int i;
+
+  for (i = 0; i < LSH_HASH_BUCKETS; i++) {
+    for (e = lsh_hash_table[i]; e != NULL; e = next) {
+      next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
     }
+    lsh_hash_table[i] = NULL;
   }
-
-  // If we're at this point, then args[0] wasn't in the list of shell builtins.
-  // Pass off args to lsh_launch, and return the result.
-  return lsh_launch(args);
 }
 
-#define LSH_RL_BUFSIZE 1024
 /**
- * @brief Read a line of input from stdin.
- * @return The line from stdin.
+ * @brief Forget one command in the hash, say because it wasn't where the hash
+ *        said it would be.
+ * @param name Name of the command.
  */
-char *lsh_read_line(void) {
-  int bufsize = LSH_RL_BUFSIZE;
-  int position = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
-  int c;
+void lsh_hash_forget(const char *name) {
+  struct lsh_hash_entry **p = &lsh_hash_table[lsh_hash_bucket(name)];
+  struct lsh_hash_entry *e;
 
-  if (!buffer) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+  for (; (e = *p) != NULL; p = &e->next) {
+    if (strcmp(e->name, name) == 0) {
+      *p = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      return;
+    }
   }
+}
+
+/**
+ * @brief Search the PATH for a command, the way execvp() would.
+ * @param name Name of the command. It must not contain a '/'.
+ * @param path The PATH to search.
+ * @return Full path of the command (to be freed), or NULL if it isn't found.
+ */
+char *lsh_path_search(const char *name, const char *path) {
+  size_t namelen = strlen(name);
+  const char *dir = path;
+  struct stat st;
 
   while (1) {
-    // Read a character
-    c = getchar();
+    const char *end = strchrnul(dir, ':');
+    size_t dirlen = end - dir;
+    char *full = lsh_malloc(dirlen + namelen + 3);
 
-    // If we hit EOF or '\n', replace it with a null character and return.
-    if (c == EOF || c == '\n') {
-      buffer[position] = '\0';
-      return buffer;
+    // An empty directory in the PATH means the current directory.
+    if (dirlen == 0) {
+      full[dirlen++] = '.';
     } else {
-      buffer[position] = c;
+      memcpy(full, dir, dirlen);
     }
+    full[dirlen] = '/';
+    memcpy(full + dirlen + 1, name, namelen + 1);
 
-    position++;
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(full, X_OK) == 0) {
+      return full;
+    }
+    free(full);
 
-    // If we have exceeded the buffer, reallocate.
-    if (position >= bufsize) {
-      bufsize += LSH_RL_BUFSIZE;
-      
-      buffer = realloc(buffer, bufsize);
+    if (*end == '\0') {
+      return NULL;
+    }
+    dir = end + 1;
+  }
+}
 
-      if (!buffer) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
+/**
+ * @brief Find a command, in the hash if it's there, or else in the PATH (and
+ *        then remember where it was found, unless it was in a relative
+ *        directory). The whole hash is forgotten if the PATH has changed since
+ *        it was filled.
+ * @param name Name of the command.
+ * @return Path of the command, or NULL if it isn't found. The path belongs to
+ *         the hash, and is only good until the next lookup if it's relative
+ *         (or is `name`, if it contains a '/').
+ */
+const char *lsh_hash_lookup(const char *name) {
+  const char *path = getenv("PATH");
+  struct lsh_hash_entry *e;
+  unsigned int b;
+  char *full;
+
+  if (strchr(name, '/') != NULL) {
+    return name;
+  }
+
+  if (path == NULL) {
+    path = LSH_DEFAULT_PATH;
+  }
+  if (lsh_hash_path == NULL || strcmp(path, lsh_hash_path) != 0) {
+    lsh_hash_clear();
+    free(lsh_hash_path);
+    lsh_hash_path = lsh_strdup(path);
+  }
+
+  b = lsh_hash_bucket(name);
+  for (e = lsh_hash_table[b]; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      e->hits++;
+      return e->path;
+    }
+  }
+
+  free(lsh_hash_relative);
+  lsh_hash_relative = NULL;
+
+  full = lsh_path_search(name, path);
+  if (full == NULL) {
+    return NULL;
+  }
+  if (full[0] != '/') {
+    lsh_hash_relative = full;
+    return full;
+  }
+
+  e = lsh_malloc(sizeof(*e));
+  e->name = lsh_strdup(name);
+  e->path = full;
+  e->hits = 0;
+  e->next = lsh_hash_table[b];
+  lsh_hash_table[b] = e;
+  return e->path;
+}
+
+/**
+ * @brief Builtin command: show or change the command hash. With no arguments,
+ *        list every command in it. `hash -r` forgets them all, and `hash NAME`
+ *        looks up NAME and remembers it.
+ * @param args List of args. `args[0]` is "hash".
+ * @return Always returns 1, to continue executing.
+ */
+int lsh_hash(char **args) {
+  struct lsh_hash_entry *e;
+  int i;
+
+  if (args[1] == NULL) {
+    printf("hits\tcommand\n");
+    for (i = 0; i < LSH_HASH_BUCKETS; i++) {
+      for (e = lsh_hash_table[i]; e != NULL; e = e->next) {
+        printf("%4d\t%s\n", e->hits, e->path);
       }
     }
+    return 1;
+  }
+
+  for (i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-r") == 0) {
+      lsh_hash_clear();
+    } else if (lsh_hash_lookup(args[i]) == NULL) {
+      fprintf(stderr, "lsh: hash: %s: not found\n", args[i]);
+    }
   }
+  return 1;
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
+/*
+ * Arena: memory for the command being run, all given back at once when it
+ * finishes.
+ */
+
+#define LSH_ARENA_BLOCK 4096
+
+struct lsh_arena_block {
+  struct lsh_arena_block *prev;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+struct lsh_arena {
+  struct lsh_arena_block *top;  // The block being allocated from, or NULL.
+};
+
+struct lsh_arena lsh_cmd_arena;
+
 /**
- * @brief (Niavely) split a line into tokens.
- * @param line The line.
- * @return NULL-terminated array of tokens.
+ * @brief Allocate memory from an arena. It's aligned for anything.
+ * @param a The arena.
+ * @param size Number of bytes.
+ * @return The memory, good until the arena is reset.
  */
-char **lsh_split_line(char *line) {
-  int bufsize = LSH_TOK_BUFSIZE;
-  int position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token;
+void *lsh_arena_alloc(struct lsh_arena *a, size_t size) {
+  struct lsh_arena_block *b = a->top;
+  size_t align = sizeof(max_align_t);
+  void *p;
 
-  if (!tokens) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+  size = (size + align - 1) / align * align;
+
+  // Each block is at least twice the size of the one before it, so anything
+  // needs only a few of them.
+  if (b == NULL || b->size - b->used < size) {
+    size_t bsize = b ? b->size * 2 : LSH_ARENA_BLOCK;
+
+    while (bsize < size) {
+      bsize *= 2;
+    }
+    b = lsh_malloc(sizeof(struct lsh_arena_block) + bsize);
+    b->prev = a->top;
+    b->size = bsize;
+    b->used = 0;
+    a->top = b;
+  }
+
+  p = (char *) b->data + b->used;
+  b->used += size;
+  return p;
+}
+
+/**
+ * @brief Make an allocation from an arena bigger, the way realloc() does.
+ * @param a The arena.
+ * @param p The allocation.
+ * @param old Its size.
+ * @param size Its new size.
+ * @return The new allocation (the old one is only given back on reset).
+ */
+void *lsh_arena_grow(struct lsh_arena *a, void *p, size_t old, size_t size) {
+  return memcpy(lsh_arena_alloc(a, size), p, old);
+}
+
+/**
+ * @brief Give back everything allocated from an arena. If it took more than
+ *        one block, they're replaced by one block as big as them all, so that
+ *        the same again won't need to allocate anything.
+ * @param a The arena.
+ */
+void lsh_arena_reset(struct lsh_arena *a) {
+  struct lsh_arena_block *b, *prev;
+  size_t total = 0;
+
+  if (a->top == NULL) {
+    return;
+  }
+
+  if (a->top->prev != NULL) {
+    for (b = a->top; b != NULL; b = prev) {
+      prev = b->prev;
+      total += b->size;
+      free(b);
+    }
+    a->top = lsh_malloc(sizeof(struct lsh_arena_block) + total);
+    a->top->prev = NULL;
+    a->top->size = total;
+  }
+  a->top->used = 0;
+}
+
+/**
+ * @brief Free everything an arena has, so that it can be thrown away.
+ * @param a The arena.
+ */
+void lsh_arena_free(struct lsh_arena *a) {
+  struct lsh_arena_block *b, *prev;
+
+  for (b = a->top; b != NULL; b = prev) {
+    prev = b->prev;
+    free(b);
   }
+  a->top = NULL;
+}
+
+/*
+ * Pipelines: commands joined by '|', each with its own redirections.
+ */
 
-  token = strtok(line, LSH_TOK_DELIM);
+// What pipes between commands are resized to (if the system allows it), so
+// that a fast writer isn't woken up for every 64 KiB a reader takes.
+#define LSH_PIPE_SIZE (1 << 20)
 
-  while (token != NULL) {
-    tokens[position] = token;
+/*
+ * Operators. The tokenizer points at these, so that a parser can tell an
+ * operator from a quoted word that looks like one by its address.
+ */
+char lsh_op_pipe[] = "|";
+char lsh_op_in[] = "<";
+char lsh_op_out[] = ">";
+char lsh_op_append[] = ">>";
+char lsh_op_background[] = "&";
 
-    position++;
+struct lsh_command {
+  char **args;      // NULL-terminated, and part of the list of tokens.
+  char *in;         // File named after '<', or NULL.
+  char *out;        // File named after '>' or '>>', or NULL.
+  int append;       // Whether it was '>>'.
+};
 
-    if (position >= bufsize) {
-      bufsize += LSH_TOK_BUFSIZE;
+/**
+ * @brief Check whether a token is one of the operators '|', '<', '>', '>>' or
+ *        '&' (rather than a quoted word that looks like one).
+ */
+int lsh_is_operator(const char *token) {
+  return token == lsh_op_pipe || token == lsh_op_in || token == lsh_op_out ||
+      token == lsh_op_append || token == lsh_op_background;
+}
 
-      tokens = realloc(tokens, bufsize * sizeof(char*));
+/**
+ * @brief Split a list of tokens into the commands of a pipeline, in place:
+ *        each '|' becomes the NULL that ends a command, and redirections (and
+ *        a '&' at the end) are taken out.
+ * @param tokens NULL-terminated list of tokens.
+ * @param cmds Set to the commands (allocated from the command arena), unless
+ *             there is an error.
+ * @param background Set to whether the pipeline ends in '&'.
+ * @return Number of commands, or -1 if there is a syntax error (which is
+ *         reported).
+ */
+int lsh_parse_pipeline(char **tokens, struct lsh_command **cmds,
+    int *background) {
+  int ncmds = 1;
+  int r, w, i;
+  struct lsh_command *cmd;
 
-      if (!tokens) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
+  for (r = 0; tokens[r] != NULL; r++) {
+    if (tokens[r] == lsh_op_pipe) {
+      ncmds++;
+    }
+  }
+
+  *cmds = lsh_arena_alloc(&lsh_cmd_arena,
+      ncmds * sizeof(struct lsh_command));
+  cmd = *cmds;
+  cmd->args = tokens;
+  cmd->in = cmd->out = NULL;
+  cmd->append = 0;
+  *background = 0;
+
+  // Tokens are only ever moved back, so w never passes r.
+  for (r = w = 0; tokens[r] != NULL; r++) {
+    char *token = tokens[r];
+
+    if (token == lsh_op_pipe) {
+      tokens[w++] = NULL;
+      cmd++;
+      cmd->args = &tokens[w];
+      cmd->in = cmd->out = NULL;
+      cmd->append = 0;
+    } else if (token == lsh_op_background) {
+      if (tokens[r + 1] != NULL) {
+        fprintf(stderr, "lsh: syntax error near `%s'\n", tokens[r + 1]);
+        return -1;
+      }
+      *background = 1;
+    } else if (lsh_is_operator(token)) {
+      char *file = tokens[r + 1];
+
+      if (file == NULL || lsh_is_operator(file)) {
+        fprintf(stderr, "lsh: syntax error near `%s'\n",
+            file == NULL ? "newline" : file);
+        return -1;
+      }
+
+      if (token[0] == '<') {
+        cmd->in = file;
+      } else {
+        cmd->out = file;
+        cmd->append = token[1] == '>';
       }
+      r++;
+    } else {
+      tokens[w++] = token;
     }
+  }
+  tokens[w] = NULL;
 
-    token = strtok(NULL, LSH_TOK_DELIM);
+  // Only a command on its own can be empty (and then only redirect).
+  for (i = 0; (ncmds > 1 || *background) && i < ncmds; i++) {
+    if ((*cmds)[i].args[0] == NULL) {
+      fprintf(stderr, "lsh: syntax error near `%s'\n",
+          ncmds > 1 ? "|" : "&");
+      return -1;
+    }
   }
 
-  tokens[position] = NULL;
+  return ncmds;
+}
 
-  return tokens;
+/**
+ * @brief Open the files a command redirects to or from.
+ * @param cmd The command.
+ * @param in Set to the file to read from, if there is one.
+ * @param out Set to the file to write to, if there is one.
+ * @return 0, or -1 if a file can't be opened (which is reported, and nothing
+ *         is left open).
+ */
+int lsh_open_redirects(struct lsh_command *cmd, int *in, int *out) {
+  int fd;
+
+  if (cmd->in != NULL) {
+    fd = open(cmd->in, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "lsh: %s: %s\n", cmd->in, strerror(errno));
+      return -1;
+    }
+    *in = fd;
+  }
+
+  if (cmd->out != NULL) {
+    fd = open(cmd->out, O_WRONLY | O_CREAT | O_CLOEXEC |
+        (cmd->append ? O_APPEND : O_TRUNC), 0666);
+    if (fd == -1) {
+      fprintf(stderr, "lsh: %s: %s\n", cmd->out, strerror(errno));
+      if (cmd->in != NULL) {
+        close(*in);
+      }
+      return -1;
+    }
+    *out = fd;
+  }
+
+  return 0;
 }
 
 /**
- * @brief Loop, getting input and then executing it.
+ * @brief Run a builtin command in the shell, with its output (and input)
+ *        redirected for as long as it runs.
+ * @param cmd The command.
+ * @param builtin The builtin.
+ * @return What the builtin returns, or 1 if its files can't be opened.
  */
-void lsh_loop(void) {
-  char *line;
-  char **args;
+int lsh_run_builtin(struct lsh_command *cmd, struct lsh_builtin *builtin) {
+  int in = STDIN_FILENO, out = STDOUT_FILENO;
+  int saved_in = -1, saved_out = -1;
   int status;
 
-  do {
-    printf("> ");
-    line = lsh_read_line();
-    args = lsh_split_line(line);
-    status = lsh_execute(args);
+  if (lsh_open_redirects(cmd, &in, &out) == -1) {
+    return 1;
+  }
 
-    free(line);
-    free(args);
-  } while(status);
+  fflush(stdout);
+  if (in != STDIN_FILENO) {
+    saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(in, STDIN_FILENO);
+    close(in);
+  }
+  if (out != STDOUT_FILENO) {
+    saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+  }
+
+  status = builtin->func(cmd->args);
+
+  fflush(stdout);
+  if (saved_in != -1) {
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+  }
+  if (saved_out != -1) {
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+  }
+
+  return status;
+}
+
+/*
+ * Accounting: what commands cost, in the children they ran and in the shell
+ * itself. `time` reports it for one command, and with LSH_STATS set in the
+ * environment, it's reported for every command, with histograms on exit.
+ */
+
+// Buckets of a histogram: 0 is under 1us, and N (up to the last) is from
+// 2^(N-1)us up to twice that.
+#define LSH_HIST_BUCKETS 32
+
+struct lsh_hist {
+  const char *name;
+  long count;
+  double total;
+  long buckets[LSH_HIST_BUCKETS];
+};
+
+struct lsh_usage {
+  double real;      // Seconds.
+  double user;      // Seconds.
+  double sys;       // Seconds.
+  long maxrss;      // KiB, of the largest child.
+  long nvcsw;
+  long nivcsw;
+  long nprocs;
+};
+
+// Everything reaped so far, except that maxrss is the largest since
+// lsh_usage_start().
+struct lsh_usage lsh_children;
+
+// The shell's own overhead for the command line being run.
+struct lsh_overhead {
+  double parse;     // Seconds tokenizing and parsing.
+  double spawn;     // Seconds starting processes.
+  int nspawns;
+} lsh_overhead;
+
+// Whether to report on every command.
+int lsh_stats;
+
+struct lsh_hist lsh_hist_real = { "real", 0, 0, { 0 } };
+struct lsh_hist lsh_hist_parse = { "parse", 0, 0, { 0 } };
+struct lsh_hist lsh_hist_spawn = { "spawn", 0, 0, { 0 } };
+
+/**
+ * @brief Get the time from a monotonic clock, in seconds.
+ */
+double lsh_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 /**
- * @brief Main entry point.
- * @param argc Argument count.
- * @param argv Argument vector.
- * @return status code
+ * @brief Add what a reaped child used to the totals.
+ * @param ru From wait4().
  */
-int main(int argc, char **argv) {
-  // TODO: Load config files (if any)
-  
+void lsh_usage_add(const struct rusage *ru) {
+  lsh_children.user += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+  lsh_children.sys += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+  if (ru->ru_maxrss > lsh_children.maxrss) {
+    lsh_children.maxrss = ru->ru_maxrss;
+  }
+  lsh_children.nvcsw += ru->ru_nvcsw;
+  lsh_children.nivcsw += ru->ru_nivcsw;
+  lsh_children.nprocs++;
+}
+
+/**
+ * @brief Start measuring a command.
+ * @param mark Set to the totals so far, and the time.
+ */
+void lsh_usage_start(struct lsh_usage *mark) {
+  *mark = lsh_children;
+  mark->real = lsh_now();
+  lsh_children.maxrss = 0;
+}
+
+/**
+ * @brief Find out what a command has used since lsh_usage_start().
+ * @param mark What lsh_usage_start() set.
+ * @param u Set to what's been used.
+ */
+void lsh_usage_since(const struct lsh_usage *mark, struct lsh_usage *u) {
+  u->real = lsh_now() - mark->real;
+  u->user = lsh_children.user - mark->user;
+  u->sys = lsh_children.sys - mark->sys;
+  u->maxrss = lsh_children.maxrss;
+  u->nvcsw = lsh_children.nvcsw - mark->nvcsw;
+  u->nivcsw = lsh_children.nivcsw - mark->nivcsw;
+  u->nprocs = lsh_children.nprocs - mark->nprocs;
+}
+
+/**
+ * @brief Add a measurement to a histogram.
+ * @param h The histogram.
+ * @param t The measurement, in seconds.
+ */
+void lsh_hist_add(struct lsh_hist *h, double t) {
+  double us = t * 1e6;
+  int b = 0;
+
+  while (us >= 1 && b < LSH_HIST_BUCKETS - 1) {
+    us /= 2;
+    b++;
+  }
+  h->buckets[b]++;
+  h->count++;
+  h->total += t;
+}
+
+/**
+ * @brief Print a histogram to stderr, one line per bucket that has anything
+ *        in it.
+ */
+void lsh_hist_print(const struct lsh_hist *h) {
+  long most = 0;
+  int b;
+
+  fprintf(stderr, "%s: %ld, mean %.1fus\n", h->name, h->count,
+      h->count ? h->total / h->count * 1e6 : 0.0);
+  for (b = 0; b < LSH_HIST_BUCKETS; b++) {
+    if (h->buckets[b] > most) {
+      most = h->buckets[b];
+    }
+  }
+  for (b = 0; b < LSH_HIST_BUCKETS; b++) {
+    if (h->buckets[b] > 0) {
+      int bar = (int) (h->buckets[b] * 40 / most);
+
+      fprintf(stderr, "  %10ldus %8ld |%.*s\n", b ? 1L << (b - 1) : 0L,
+          h->buckets[b], bar > 0 ? bar : 1,
+          "########################################");
+    }
+  }
+}
+
+/**
+ * @brief Print every histogram, if stats are on.
+ */
+void lsh_stats_dump(void) {
+  if (!lsh_stats) {
+    return;
+  }
+  lsh_hist_print(&lsh_hist_real);
+  lsh_hist_print(&lsh_hist_parse);
+  lsh_hist_print(&lsh_hist_spawn);
+}
+
+/**
+ * @brief Report what a command used to stderr, the way `time` does.
+ * @param u What it used.
+ */
+void lsh_usage_print(const struct lsh_usage *u) {
+  fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", u->real, u->user,
+      u->sys);
+  fprintf(stderr, "maxrss\t%ld KiB\ncsw\t%ld voluntary, %ld involuntary\n",
+      u->maxrss, u->nvcsw, u->nivcsw);
+  fprintf(stderr, "shell\tparse %.1fus, spawn %.1fus (%d started)\n",
+      lsh_overhead.parse * 1e6, lsh_overhead.spawn * 1e6,
+      lsh_overhead.nspawns);
+}
+
+/*
+ * Jobs: pipelines that have been launched, and what has become of them. When
+ * a child changes state, SIGCHLD writes to a pipe, and whatever the shell is
+ * waiting for (input, or a job) wakes up and reaps it.
+ */
+
+enum lsh_state {
+  LSH_RUNNING,
+  LSH_STOPPED,
+  LSH_DONE
+};
+
+struct lsh_process {
+  pid_t pid;
+  enum lsh_state state;
+  int status;       // From waitpid(), once it's done.
+};
+
+struct lsh_job {
+  int id;
+  pid_t pgid;       // Process group, or -1 without job control.
+  int background;
+  int notified;     // Whether it's been reported as stopped.
+  char *text;       // The command line, for `jobs`.
+  struct lsh_job *next;
+  int nprocs;
+  struct lsh_process procs[];
+};
+
+// Every job, in order of ID.
+struct lsh_job *lsh_job_list;
+
+// Whether jobs get process groups of their own and the terminal is handed to
+// them (as the shell is interactive).
+int lsh_job_control;
+pid_t lsh_shell_pgid;
+struct termios lsh_shell_tmodes;
+
+// Signals that the shell ignores when it has job control, and that children
+// get back.
+int lsh_job_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+
+// The self-pipe that SIGCHLD writes to.
+int lsh_sigchld_pipe[2] = { -1, -1 };
+
+/**
+ * @brief Handle SIGCHLD, by waking up whatever is waiting for the self-pipe.
+ */
+void lsh_sigchld(int sig) {
+  int saved = errno;
+  char c = 0;
+
+  (void) sig;
+  if (write(lsh_sigchld_pipe[1], &c, 1) == -1) {
+    // The pipe is full, so there's already a wake-up in it.
+  }
+  errno = saved;
+}
+
+/**
+ * @brief Set up the self-pipe, and job control if the shell is interactive.
+ * @param interactive Whether it is.
+ */
+void lsh_jobs_init(int interactive) {
+  struct sigaction sa;
+  size_t i;
+
+  if (pipe2(lsh_sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("lsh");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lsh_sigchld;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+
+  // Take the terminal, leaving Ctrl-C and Ctrl-Z to whichever job has it.
+  lsh_job_control = interactive;
+  if (lsh_job_control) {
+    for (i = 0; i < sizeof(lsh_job_signals) / sizeof(int); i++) {
+      signal(lsh_job_signals[i], SIG_IGN);
+    }
+    setpgid(0, 0);
+    lsh_shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, lsh_shell_pgid);
+    tcgetattr(STDIN_FILENO, &lsh_shell_tmodes);
+  }
+}
+
+/**
+ * @brief Start afresh in a forked child that runs a builtin: without the
+ *        shell's jobs, without job control, and with a self-pipe of its own
+ *        (so that it doesn't take the shell's wake-ups).
+ */
+void lsh_jobs_child(void) {
+  close(lsh_sigchld_pipe[0]);
+  close(lsh_sigchld_pipe[1]);
+  if (pipe2(lsh_sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("lsh");
+    _exit(EXIT_FAILURE);
+  }
+  lsh_job_list = NULL;
+  lsh_job_control = 0;
+}
+
+/**
+ * @brief Make a new job for a pipeline, and add it to the list.
+ * @param cmds The commands of the pipeline.
+ * @param ncmds Number of commands.
+ * @param background Whether it was run with '&'.
+ * @return The job. Its processes are filled in as they're started.
+ */
+struct lsh_job *lsh_job_new(struct lsh_command *cmds, int ncmds,
+    int background) {
+  struct lsh_job *job, **p;
+  size_t len = 0;
+  char *t;
+  int i, j;
+
+  for (i = 0; i < ncmds; i++) {
+    for (j = 0; cmds[i].args[j] != NULL; j++) {
+      len += strlen(cmds[i].args[j]) + 1;
+    }
+    len += (cmds[i].in ? strlen(cmds[i].in) + 3 : 0) +
+        (cmds[i].out ? strlen(cmds[i].out) + 4 : 0) + 2;
+  }
+  len += 2;
+
+  job = lsh_malloc(sizeof(struct lsh_job) +
+      ncmds * sizeof(struct lsh_process) + len + 1);
+  job->pgid = -1;
+  job->background = background;
+  job->notified = 0;
+  job->nprocs = 0;
+  job->text = t = (char *) &job->procs[ncmds];
+
+  for (i = 0; i < ncmds; i++) {
+    if (i > 0) {
+      t += sprintf(t, " | ");
+    }
+    for (j = 0; cmds[i].args[j] != NULL; j++) {
+      t += sprintf(t, j > 0 ? " %s" : "%s", cmds[i].args[j]);
+    }
+    if (cmds[i].in) {
+      t += sprintf(t, " < %s", cmds[i].in);
+    }
+    if (cmds[i].out) {
+      t += sprintf(t, cmds[i].append ? " >> %s" : " > %s", cmds[i].out);
+    }
+  }
+  if (background) {
+    t += sprintf(t, " &");
+  }
+
+  // Take the next ID after the highest in use, and go on the end.
+  job->id = 1;
+  for (p = &lsh_job_list; *p != NULL; p = &(*p)->next) {
+    job->id = (*p)->id + 1;
+  }
+  job->next = NULL;
+  *p = job;
+  return job;
+}
+
+/**
+ * @brief Take a job off the list, and free it.
+ */
+void lsh_job_free(struct lsh_job *job) {
+  struct lsh_job **p;
+
+  for (p = &lsh_job_list; *p != NULL; p = &(*p)->next) {
+    if (*p == job) {
+      *p = job->next;
+      break;
+    }
+  }
+  free(job);
+}
+
+/**
+ * @brief Find out what state a job is in: running if any of its processes
+ *        are, or else stopped if any of them are, or else done.
+ */
+enum lsh_state lsh_job_state(struct lsh_job *job) {
+  enum lsh_state state = LSH_DONE;
+  int i;
+
+  for (i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].state < state) {
+      state = job->procs[i].state;
+    }
+  }
+  return state;
+}
+
+/**
+ * @brief Reap every child that has changed state, without blocking, and
+ *        update its job.
+ */
+void lsh_reap(void) {
+  struct rusage ru;
+  struct lsh_job *job;
+  char buf[64];
+  pid_t pid;
+  int status;
+  int i;
+
+  while (read(lsh_sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+  }
+
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+      &ru)) > 0) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      lsh_usage_add(&ru);
+    }
+
+    for (job = lsh_job_list; job != NULL; job = job->next) {
+      for (i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid == pid) {
+          break;
+        }
+      }
+      if (i < job->nprocs) {
+        break;
+      }
+    }
+    if (job == NULL) {
+      continue;
+    }
+
+    if (WIFSTOPPED(status)) {
+      job->procs[i].state = LSH_STOPPED;
+      job->notified = 0;
+    } else if (WIFCONTINUED(status)) {
+      job->procs[i].state = LSH_RUNNING;
+    } else {
+      job->procs[i].state = LSH_DONE;
+      job->procs[i].status = status;
+    }
+  }
+}
+
+/**
+ * @brief Wait for a child to change state, and reap it.
+ */
+void lsh_wait_event(void) {
+  struct pollfd pfd = { lsh_sigchld_pipe[0], POLLIN, 0 };
+
+  if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+    perror("lsh");
+  }
+  lsh_reap();
+}
+
+/**
+ * @brief Print a line about a job, the way `jobs` does.
+ */
+void lsh_job_print(struct lsh_job *job) {
+  enum lsh_state state = lsh_job_state(job);
+  char what[32];
+  int status;
+
+  if (state == LSH_RUNNING) {
+    snprintf(what, sizeof(what), "Running");
+  } else if (state == LSH_STOPPED) {
+    snprintf(what, sizeof(what), "Stopped");
+  } else {
+    status = job->procs[job->nprocs - 1].status;
+    if (WIFSIGNALED(status)) {
+      snprintf(what, sizeof(what), "%s", strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status) != 0) {
+      snprintf(what, sizeof(what), "Exit %d", WEXITSTATUS(status));
+    } else {
+      snprintf(what, sizeof(what), "Done");
+    }
+  }
+  printf("[%d]  %-24s%s\n", job->id, what, job->text);
+}
+
+/**
+ * @brief Report jobs that have stopped or finished since they were last
+ *        reported (if the shell is interactive), and forget finished ones.
+ */
+void lsh_job_notify(void) {
+  struct lsh_job *job, *next;
+  enum lsh_state state;
+
+  lsh_reap();
+  for (job = lsh_job_list; job != NULL; job = next) {
+    next = job->next;
+    state = lsh_job_state(job);
+
+    if (state == LSH_DONE) {
+      if (lsh_job_control && job->background) {
+        lsh_job_print(job);
+      }
+      lsh_job_free(job);
+    } else if (state == LSH_STOPPED && !job->notified) {
+      lsh_job_print(job);
+      job->notified = 1;
+    }
+  }
+}
+
+/**
+ * @brief Send a signal to every process of a job.
+ */
+void lsh_job_kill(struct lsh_job *job, int sig) {
+  int i;
+
+  if (job->pgid != -1) {
+    kill(-job->pgid, sig);
+    return;
+  }
+  for (i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].state != LSH_DONE) {
+      kill(job->procs[i].pid, sig);
+    }
+  }
+}
+
+/**
+ * @brief Mark a stopped job as running again, and let it continue.
+ */
+void lsh_job_continue(struct lsh_job *job) {
+  int i;
+
+  for (i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].state == LSH_STOPPED) {
+      job->procs[i].state = LSH_RUNNING;
+    }
+  }
+  job->notified = 0;
+  lsh_job_kill(job, SIGCONT);
+}
+
+/**
+ * @brief Run a job in the foreground: give it the terminal, and wait until it
+ *        finishes (and is forgotten) or stops (and is reported).
+ * @param job The job.
+ * @param cont Whether to continue it first.
+ */
+void lsh_job_foreground(struct lsh_job *job, int cont) {
+  enum lsh_state state;
+  int status;
+
+  job->background = 0;
+  if (lsh_job_control) {
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+  }
+  if (cont) {
+    lsh_job_continue(job);
+  }
+
+  // A child that's changed state before this is already in the pipe.
+  while ((state = lsh_job_state(job)) == LSH_RUNNING) {
+    lsh_wait_event();
+  }
+
+  if (lsh_job_control) {
+    tcsetpgrp(STDIN_FILENO, lsh_shell_pgid);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &lsh_shell_tmodes);
+  }
+
+  if (state == LSH_DONE) {
+    // The terminal has "^C" on it, and the prompt would follow on.
+    status = job->procs[job->nprocs - 1].status;
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+      printf("\n");
+    }
+    lsh_job_free(job);
+  } else {
+    printf("\n");
+    lsh_job_print(job);
+    job->notified = 1;
+  }
+}
+
+/**
+ * @brief Find the job named by an argument to `fg`, `bg` or `wait`: "%N" or
+ *        "N" for job N, or (with no argument) the latest job.
+ * @param name The argument, or NULL.
+ * @param builtin Name of the builtin, for the error.
+ * @return The job, or NULL if there isn't one (which is reported).
+ */
+struct lsh_job *lsh_job_find(const char *name, const char *builtin) {
+  struct lsh_job *job, *last = NULL;
+  int id;
+
+  if (name == NULL) {
+    for (job = lsh_job_list; job != NULL; job = job->next) {
+      last = job;
+    }
+    if (last == NULL) {
+      fprintf(stderr, "lsh: %s: no current job\n", builtin);
+    }
+    return last;
+  }
+
+  id = atoi(name[0] == '%' ? name + 1 : name);
+  for (job = lsh_job_list; job != NULL; job = job->next) {
+    if (job->id == id) {
+      return job;
+    }
+  }
+  fprintf(stderr, "lsh: %s: %s: no such job\n", builtin, name);
+  return NULL;
+}
+
+/**
+ * @brief Builtin command: list jobs.
+ * @param args List of args.  Not examined.
+ * @return Always returns 1, to continue executing.
+ */
+int lsh_jobs(char **args) {
+  struct lsh_job *job, *next;
+
+  (void) args;
+  lsh_reap();
+  for (job = lsh_job_list; job != NULL; job = next) {
+    next = job->next;
+    lsh_job_print(job);
+    if (lsh_job_state(job) == LSH_DONE) {
+      lsh_job_free(job);
+    } else {
+      job->notified = 1;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Builtin command: run a job in the foreground.
+ * @param args List of args. `args[1]`, if there is one, names the job.
+ * @return Always returns 1, to continue executing.
+ */
+int lsh_fg(char **args) {
+  struct lsh_job *job = lsh_job_find(args[1], "fg");
+
+  if (job != NULL) {
+    printf("%s\n", job->text);
+    fflush(stdout);
+    lsh_job_foreground(job, 1);
+  }
+  return 1;
+}
+
+/**
+ * @brief Builtin command: continue a stopped job in the background.
+ * @param args List of args. `args[1]`, if there is one, names the job.
+ * @return Always returns 1, to continue executing.
+ */
+int lsh_bg(char **args) {
+  struct lsh_job *job = lsh_job_find(args[1], "bg");
+
+  if (job != NULL) {
+    job->background = 1;
+    lsh_job_continue(job);
+    printf("[%d] %s\n", job->id, job->text);
+  }
+  return 1;
+}
+
+/**
+ * @brief Builtin command: wait for jobs to finish.
+ * @param args List of args. Jobs to wait for; all of them, if there are none.
+ *             Stopped jobs aren't waited for.
+ * @return Always returns 1, to continue executing.
+ */
+int lsh_wait(char **args) {
+  struct lsh_job *job, *next;
+  int i;
+
+  for (i = 1; args[i] != NULL; i++) {
+    job = lsh_job_find(args[i], "wait");
+    while (job != NULL && lsh_job_state(job) == LSH_RUNNING) {
+      lsh_wait_event();
+    }
+  }
+
+  if (args[1] == NULL) {
+    while (1) {
+      for (job = lsh_job_list; job != NULL; job = job->next) {
+        if (lsh_job_state(job) == LSH_RUNNING) {
+          break;
+        }
+      }
+      if (job == NULL) {
+        break;
+      }
+      lsh_wait_event();
+    }
+  }
+
+  // They've been waited for, so there's nothing to report.
+  for (job = lsh_job_list; job != NULL; job = next) {
+    next = job->next;
+    if (lsh_job_state(job) == LSH_DONE) {
+      lsh_job_free(job);
+    }
+  }
+  return 1;
+}
+
+// How external programs are started, from LSH_LAUNCH and LSH_HASH in the
+// environment: with fork() and exec rather than posix_spawn(), and by having
+// exec search the PATH rather than using the command hash. Both are only there
+// so that the two ways can be compared.
+int lsh_use_fork;
+int lsh_use_hash = 1;
+
+/**
+ * @brief Start a program with fork() and exec, the way the shell used to. A
+ *        failed exec is sent back through a close-on-exec pipe, so that it's
+ *        reported just as posix_spawn() would report it.
+ * @param pid Set to ID of the process.
+ * @param path The program, or (with `search`) its name.
+ * @param args Its arguments.
+ * @param in What it reads from.
+ * @param out What it writes to.
+ * @param pgid Process group to put it in: 0 for a new one, or -1 to leave it
+ *             in the shell's.
+ * @param search Whether to search the PATH.
+ * @return 0, or an error number.
+ */
+int lsh_fork_exec(pid_t *pid, const char *path, char **args, int in, int out,
+    pid_t pgid, int search) {
+  int p[2];
+  int err = 0;
+  size_t i;
+  ssize_t n;
+
+  if (pipe2(p, O_CLOEXEC) == -1) {
+    return errno;
+  }
+
+  *pid = fork();
+  if (*pid == 0) {
+    if (pgid != -1) {
+      setpgid(0, pgid);
+    }
+    for (i = 0; lsh_job_control && i < sizeof(lsh_job_signals) / sizeof(int);
+        i++) {
+      signal(lsh_job_signals[i], SIG_DFL);
+    }
+    if (in != STDIN_FILENO) {
+      dup2(in, STDIN_FILENO);
+    }
+    if (out != STDOUT_FILENO) {
+      dup2(out, STDOUT_FILENO);
+    }
+
+    if (search) {
+      execvp(path, args);
+    } else {
+      execv(path, args);
+    }
+    err = errno;
+    if (write(p[1], &err, sizeof(err)) == -1) {
+      // There's no one else to tell.
+    }
+    _exit(127);
+  } else if (*pid < 0) {
+    err = errno;
+  } else {
+    if (pgid != -1) {
+      setpgid(*pid, pgid ? pgid : *pid);
+    }
+
+    // Nothing comes down the pipe if the exec worked: the child's end is
+    // just closed.
+    close(p[1]);
+    p[1] = -1;
+    do {
+      n = read(p[0], &err, sizeof(err));
+    } while (n == -1 && errno == EINTR);
+    if (n == sizeof(err)) {
+      waitpid(*pid, NULL, 0);
+    } else {
+      err = 0;
+    }
+  }
+
+  close(p[0]);
+  if (p[1] != -1) {
+    close(p[1]);
+  }
+  return err;
+}
+
+/**
+ * @brief Start one command of a pipeline, without waiting for it.
+ * @param cmd The command.
+ * @param in What it reads from.
+ * @param out What it writes to.
+ * @param next The end of the next pipe that the command mustn't keep open, or
+ *             -1.
+ * @param pgid Process group to put it in: 0 for a new one, or -1 to leave it
+ *             in the shell's.
+ * @return ID of the process, or -1 if it couldn't be started (which is
+ *         reported).
+ */
+pid_t lsh_start_process(struct lsh_command *cmd, int in, int out, int next,
+    pid_t pgid) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigdefault;
+  short flags = 0;
+  const char *path;
+  pid_t pid;
+  struct lsh_builtin *builtin;
+  int err;
+  int retry;
+  size_t i;
+
+  // A builtin has to run in a copy of the shell.
+  builtin = lsh_find_builtin(cmd->args[0]);
+  if (builtin != NULL) {
+    pid = fork();
+    if (pid == 0) {
+      if (pgid != -1) {
+        setpgid(0, pgid);
+      }
+      for (i = 0; lsh_job_control && i < sizeof(lsh_job_signals) / sizeof(int);
+          i++) {
+        signal(lsh_job_signals[i], SIG_DFL);
+      }
+      lsh_jobs_child();
+      if (next != -1) {
+        close(next);
+      }
+      if (in != STDIN_FILENO) {
+        dup2(in, STDIN_FILENO);
+        close(in);
+      }
+      if (out != STDOUT_FILENO) {
+        dup2(out, STDOUT_FILENO);
+        close(out);
+      }
+      builtin->func(cmd->args);
+      fflush(stdout);
+      _exit(EXIT_SUCCESS);
+    } else if (pid < 0) {
+      perror("lsh");
+    } else if (pgid != -1) {
+      // Either of us may get here first.
+      setpgid(pid, pgid ? pgid : pid);
+    }
+    return pid;
+  }
+
+  // Everything the shell opens is close-on-exec, so only the command's own
+  // standard input and output need setting up. (dup2() clears the flag.)
+  posix_spawn_file_actions_init(&actions);
+  if (in != STDIN_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  }
+  if (out != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+  }
+
+  // With job control, the child gets back the signals the shell ignores, and
+  // (usually) goes in the job's process group.
+  posix_spawnattr_init(&attr);
+  if (lsh_job_control) {
+    sigemptyset(&sigdefault);
+    for (i = 0; i < sizeof(lsh_job_signals) / sizeof(int); i++) {
+      sigaddset(&sigdefault, lsh_job_signals[i]);
+    }
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+  }
+  if (pgid != -1) {
+    posix_spawnattr_setpgroup(&attr, pgid);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  // Start the program without duplicating this process. posix_spawn() runs
+  // the child in our memory until it execs (with vfork() or clone(CLONE_VM)),
+  // so there are no page tables to copy, however big the shell gets. It also
+  // reports a failed exec by its return value. The program is exec'd straight
+  // from the command hash, rather than by trying every directory in the PATH.
+  // If it isn't where the hash says any more, look for it again.
+  retry = 1;
+  do {
+    path = lsh_use_hash ? lsh_hash_lookup(cmd->args[0]) : cmd->args[0];
+    if (path == NULL) {
+      err = ENOENT;
+      break;
+    }
+
+    if (lsh_use_fork) {
+      err = lsh_fork_exec(&pid, path, cmd->args, in, out, pgid, !lsh_use_hash);
+    } else if (lsh_use_hash) {
+      err = posix_spawn(&pid, path, &actions, &attr, cmd->args, environ);
+    } else {
+      err = posix_spawnp(&pid, path, &actions, &attr, cmd->args, environ);
+    }
+    if (err == ENOENT && path != cmd->args[0]) {
+      lsh_hash_forget(cmd->args[0]);
+    } else {
+      retry = 0;
+    }
+  } while (retry--);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (err != 0) {
+    // Error spawning.
+    errno = err;
+    perror("lsh");
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * @brief Start one command of a pipeline, without waiting for it, and count
+ *        the time it takes towards the shell's overhead.
+ * @param cmd The command.
+ * @param in What it reads from.
+ * @param out What it writes to.
+ * @param next The end of the next pipe that the command mustn't keep open, or
+ *             -1.
+ * @param pgid Process group to put it in: 0 for a new one, or -1 to leave it
+ *             in the shell's.
+ * @return ID of the process, or -1 if it couldn't be started (which is
+ *         reported).
+ */
+pid_t lsh_spawn(struct lsh_command *cmd, int in, int out, int next,
+    pid_t pgid) {
+  double start = lsh_now();
+  pid_t pid = lsh_start_process(cmd, in, out, next, pgid);
+  double t = lsh_now() - start;
+
+  lsh_overhead.spawn += t;
+  lsh_overhead.nspawns++;
+  lsh_hist_add(&lsh_hist_spawn, t);
+  return pid;
+}
+
+/**
+ * @brief Launch the programs of a pipeline as a job. They all run at once, each
+ *        one's output piped to the next one's input.
+ * @param cmds The commands.
+ * @param ncmds Number of commands.
+ * @param background Whether to leave the job running in the background, or
+ *                   else wait for it to finish (or stop).
+ * @return Always returns 1, to continue execution.
+ */
+int lsh_launch(struct lsh_command *cmds, int ncmds, int background) {
+  struct lsh_job *job = lsh_job_new(cmds, ncmds, background);
+  pid_t pgid = lsh_job_control ? 0 : -1;
+  pid_t pid;
+  int in = STDIN_FILENO;
+  int i;
+
+  // Anything still buffered would be written again by a forked builtin.
+  fflush(stdout);
+
+  // Without job control, a job in the background mustn't read the terminal
+  // (or the rest of a script) from under the shell.
+  if (background && !lsh_job_control) {
+    in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  for (i = 0; i < ncmds; i++) {
+    int out = STDOUT_FILENO;
+    int next = -1;
+    int p[2];
+    int cmd_in, cmd_out;
+
+    if (i < ncmds - 1) {
+      if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("lsh");
+        break;
+      }
+      fcntl(p[1], F_SETPIPE_SZ, LSH_PIPE_SIZE);
+      out = p[1];
+      next = p[0];
+    }
+
+    // A redirection takes the place of the pipe. Files are opened here, rather
+    // than by the child, so that the error can name them.
+    cmd_in = in;
+    cmd_out = out;
+    if (lsh_open_redirects(&cmds[i], &cmd_in, &cmd_out) == 0) {
+      pid = lsh_spawn(&cmds[i], cmd_in, cmd_out, next, pgid);
+      if (pid != -1) {
+        // The first process leads the job's process group.
+        if (pgid == 0) {
+          pgid = pid;
+        }
+        job->procs[job->nprocs].pid = pid;
+        job->procs[job->nprocs].state = LSH_RUNNING;
+        job->nprocs++;
+      }
+      if (cmd_in != in) {
+        close(cmd_in);
+      }
+      if (cmd_out != out) {
+        close(cmd_out);
+      }
+    }
+
+    if (in != STDIN_FILENO && in != -1) {
+      close(in);
+    }
+    if (out != STDOUT_FILENO) {
+      close(out);
+    }
+    in = next;
+  }
+
+  if (in != STDIN_FILENO && in != -1) {
+    close(in);
+  }
+
+  job->pgid = pgid > 0 ? pgid : -1;
+  if (job->nprocs == 0) {
+    lsh_job_free(job);
+  } else if (background) {
+    if (lsh_job_control) {
+      printf("[%d] %d\n", job->id, job->procs[job->nprocs - 1].pid);
+    }
+  } else {
+    lsh_job_foreground(job, 0);
+  }
+
+  return 1;
+}
+
+/**
+ * @brief Execute shell built-in or launch program.
+ * @param args NULL-terminated list of arguments.
+ * @return 1 if the shell should continue running, or 0 if it should terminate.
+ */
+int lsh_execute(char **args) {
+  struct lsh_command *cmds;
+  int ncmds;
+  int background;
+  struct lsh_builtin *builtin;
+  int status;
+  double start;
+
+  if (args[0] == NULL) {
+    // An empty command was entered, so do nothing and let the shell
+    // continue executing.
+    return 1;
+  }
+
+  // `time` times the whole pipeline after it, so it comes before the pipeline
+  // is split up.
+  if (strcmp(args[0], "time") == 0) {
+    return lsh_time(args);
+  }
+
+  start = lsh_now();
+  ncmds = lsh_parse_pipeline(args, &cmds, &background);
+  lsh_overhead.parse += lsh_now() - start;
+  if (ncmds == -1) {
+    return 1;
+  }
+
+  if (ncmds == 1 && cmds[0].args[0] == NULL) {
+    // Only redirections: create (or check) the files, and nothing else.
+    int in = STDIN_FILENO, out = STDOUT_FILENO;
+
+    if (lsh_open_redirects(&cmds[0], &in, &out) == 0) {
+      if (in != STDIN_FILENO) {
+        close(in);
+      }
+      if (out != STDOUT_FILENO) {
+        close(out);
+      }
+    }
+    status = 1;
+  } else if (ncmds == 1 && !background &&
+      (builtin = lsh_find_builtin(cmds[0].args[0])) != NULL &&
+      !(lsh_job_control && builtin->func == lsh_parallel)) {
+    // A builtin on its own runs in the shell, so that it can change it. Except
+    // that with job control, `parallel` runs as a job of its own, so that
+    // Ctrl-Z stops it and all its instances together (rather than stopping
+    // the instances under a shell that's still waiting for them), and `fg`
+    // carries them all on.
+    status = lsh_run_builtin(&cmds[0], builtin);
+  } else {
+    // Otherwise, launch the programs (and any builtins in the pipeline, or in
+    // the background, in children of their own).
+    status = lsh_launch(cmds, ncmds, background);
+  }
+
+  return status;
+}
+
+/**
+ * @brief Builtin command: run a pipeline, and report what it cost.
+ * @param args List of args. `args[0]` is "time", and the rest is the pipeline.
+ * @return What running the pipeline returns.
+ */
+int lsh_time(char **args) {
+  struct lsh_usage mark, used;
+  int status;
+
+  lsh_usage_start(&mark);
+  status = lsh_execute(&args[1]);
+  lsh_reap();
+  lsh_usage_since(&mark, &used);
+  lsh_usage_print(&used);
+  return status;
+}
+
+#define LSH_RL_BUFSIZE (64 * 1024)
+
+/*
+ * Where commands are read from: the terminal, a script, or whatever stdin is.
+ * Input is read a block at a time into a buffer that is kept from line to
+ * line, and lines are handed out from it in place.
+ */
+struct lsh_input {
+  int fd;
+  int interactive;  // Whether to prompt.
+  int eof;
+  char *buf;
+  size_t size;
+  size_t pos;       // Start of the next line.
+  size_t len;       // End of what has been read.
+};
+
+/**
+ * @brief Wait until there's input to read, reaping children in the meantime.
+ * @param fd Where the input comes from.
+ */
+void lsh_wait_input(int fd) {
+  struct pollfd pfds[2] = {
+    { fd, POLLIN, 0 },
+    { lsh_sigchld_pipe[0], POLLIN, 0 }
+  };
+
+  while (1) {
+    if (poll(pfds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (pfds[1].revents & POLLIN) {
+      lsh_reap();
+    }
+    if (pfds[0].revents) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Read a line of input.
+ * @param in Where to read it from.
+ * @return The line, without its '\n'. It's only valid until the next line is
+ *         read. NULL at the end of the input.
+ */
+char *lsh_read_line(struct lsh_input *in) {
+  size_t from = in->pos;
+  char *line;
+  char *nl;
+  ssize_t n;
+
+  while (1) {
+    // If the buffer has a whole line in it, replace the '\n' with a null
+    // character and return it.
+    nl = from < in->len ? memchr(in->buf + from, '\n', in->len - from) : NULL;
+    if (nl != NULL) {
+      *nl = '\0';
+      line = in->buf + in->pos;
+      in->pos = nl + 1 - in->buf;
+      return line;
+    }
+
+    // If we hit EOF, the last line may not have had a '\n'.
+    if (in->eof) {
+      if (in->pos == in->len) {
+        return NULL;
+      }
+      in->buf[in->len] = '\0';
+      line = in->buf + in->pos;
+      in->pos = in->len;
+      return line;
+    }
+
+    // Move the start of the line to the front, and make sure the buffer has
+    // room for another block (and a null character).
+    from = in->len - in->pos;
+    if (in->pos > 0) {
+      memmove(in->buf, in->buf + in->pos, from);
+    }
+    in->len = from;
+    in->pos = 0;
+
+    if (in->size - in->len < LSH_RL_BUFSIZE + 1) {
+      in->size = in->size ? in->size * 2 : LSH_RL_BUFSIZE * 2;
+      in->buf = realloc(in->buf, in->size);
+
+      if (!in->buf) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // At the terminal, reap background jobs as they finish while waiting.
+    if (in->interactive) {
+      lsh_wait_input(in->fd);
+    }
+
+    n = read(in->fd, in->buf + in->len, in->size - in->len - 1);
+    if (n > 0) {
+      in->len += n;
+    } else if (n == 0 || errno != EINTR) {
+      if (n == -1) {
+        perror("lsh");
+      }
+      in->eof = 1;
+    }
+  }
+}
+
+/*
+ * Parallel: run a command once for each of a list of arguments, a bounded
+ * number at a time.
+ */
+
+// One running instance of the command.
+struct lsh_parallel_slot {
+  struct lsh_job *job;  // NULL if the slot is free.
+  int fd;               // Where its output is collected from, or -1.
+  char *buf;            // Its output so far, if it's being grouped.
+  size_t len;
+  size_t size;
+};
+
+/**
+ * @brief Make the arguments for one instance of a command: `{}` in any of the
+ *        words is replaced by the argument, or if there's no `{}` at all, the
+ *        argument is added to the end.
+ * @param a Arena to allocate them from.
+ * @param words The command's words.
+ * @param nwords Number of words.
+ * @param arg The argument.
+ * @return NULL-terminated list of arguments.
+ */
+char **lsh_parallel_args(struct lsh_arena *a, char **words, int nwords,
+    const char *arg) {
+  char **args = lsh_arena_alloc(a, (nwords + 2) * sizeof(char *));
+  size_t arglen = strlen(arg);
+  int replaced = 0;
+  int i;
+
+  for (i = 0; i < nwords; i++) {
+    const char *w = words[i];
+    const char *brace = strstr(w, "{}");
+    size_t len = strlen(w);
+    char *out;
+
+    if (brace == NULL) {
+      args[i] = words[i];
+      continue;
+    }
+
+    // Room for every `{}` to become the argument.
+    out = args[i] = lsh_arena_alloc(a, len + (len / 2) * arglen + 1);
+    while (brace != NULL) {
+      memcpy(out, w, brace - w);
+      out += brace - w;
+      memcpy(out, arg, arglen);
+      out += arglen;
+      w = brace + 2;
+      brace = strstr(w, "{}");
+    }
+    strcpy(out, w);
+    replaced = 1;
+  }
+
+  if (!replaced) {
+    args[i++] = (char *) arg;
+  }
+  args[i] = NULL;
+  return args;
+}
+
+/**
+ * @brief Start one instance of a command in a free slot.
+ * @param slot The slot.
+ * @param args Its arguments.
+ * @param group Whether to collect its output, rather than let it write to
+ *              stdout as it goes.
+ * @return 0, or -1 if it couldn't be started (which is reported).
+ */
+int lsh_parallel_start(struct lsh_parallel_slot *slot, char **args,
+    int group) {
+  struct lsh_command cmd = { args, NULL, NULL, 0 };
+  int out = STDOUT_FILENO;
+  int p[2];
+  pid_t pid;
+
+  if (group) {
+    if (pipe2(p, O_CLOEXEC) == -1) {
+      perror("lsh: parallel");
+      return -1;
+    }
+    out = p[1];
+    slot->fd = p[0];
+  }
+
+  // Each instance stays in the process group of whatever runs `parallel`
+  // (its job's, with job control), so that Ctrl-C and Ctrl-Z reach all of
+  // them.
+  pid = lsh_spawn(&cmd, STDIN_FILENO, out, group ? p[0] : -1, -1);
+  if (group) {
+    close(p[1]);
+  }
+  if (pid == -1) {
+    if (group) {
+      close(slot->fd);
+      slot->fd = -1;
+    }
+    return -1;
+  }
+
+  slot->job = lsh_job_new(&cmd, 1, 0);
+  slot->job->procs[0].pid = pid;
+  slot->job->procs[0].state = LSH_RUNNING;
+  slot->job->nprocs = 1;
+  slot->len = 0;
+  return 0;
+}
+
+/**
+ * @brief Collect what's waiting in a slot's output pipe.
+ * @param slot The slot.
+ */
+void lsh_parallel_collect(struct lsh_parallel_slot *slot) {
+  ssize_t n;
+
+  while (1) {
+    if (slot->size - slot->len < LSH_RL_BUFSIZE) {
+      slot->size = slot->size ? slot->size * 2 : LSH_RL_BUFSIZE;
+      slot->buf = realloc(slot->buf, slot->size);
+
+      if (!slot->buf) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    n = read(slot->fd, slot->buf + slot->len, slot->size - slot->len);
+    if (n > 0) {
+      slot->len += n;
+      return;
+    } else if (n == 0 || errno != EINTR) {
+      // The command (and anything it left running) has closed its output.
+      close(slot->fd);
+      slot->fd = -1;
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Write out all of a buffer, however many writes it takes.
+ */
+void lsh_write_all(int fd, const char *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief Builtin command: run a command for each of a list of arguments, with
+ *        at most N at a time.
+ *
+ *   parallel [-j N] [-g] COMMAND... [::: ARG...]
+ *
+ * Without `:::`, the arguments are the lines of stdin. N is the number of CPUs
+ * unless it's given, and `-g` collects each instance's output and writes it
+ * out in one piece when it finishes, so that instances' output isn't mixed
+ * up. When one instance finishes, the next is started straight away.
+ * @param args List of args. `args[0]` is "parallel".
+ * @return Always returns 1, to continue executing.
+ */
+int lsh_parallel(char **args) {
+  struct lsh_arena arena = { NULL };
+  struct lsh_input input = { STDIN_FILENO, 0, 0, NULL, 0, 0, 0 };
+  struct lsh_parallel_slot *slots;
+  struct pollfd *pfds;
+  char **words, **list = NULL;
+  const char *arg;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int group = 0;
+  int nwords;
+  int running = 0;
+  int failed = 0;
+  int stop = 0;
+  int i, n;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "-g") == 0) {
+      group = 1;
+    } else if (strncmp(args[i], "-j", 2) == 0) {
+      const char *num = args[i][2] ? &args[i][2] : args[++i];
+      jobs = num ? atol(num) : 0;
+      if (jobs < 1) {
+        fprintf(stderr, "lsh: parallel: -j needs a number of jobs\n");
+        return 1;
+      }
+    } else {
+      break;
+    }
+  }
+
+  words = &args[i];
+  for (nwords = 0; words[nwords] != NULL; nwords++) {
+    if (strcmp(words[nwords], ":::") == 0) {
+      list = &words[nwords + 1];
+      break;
+    }
+  }
+  if (nwords == 0) {
+    fprintf(stderr, "lsh: parallel: expected a command\n");
+    return 1;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  slots = calloc(jobs, sizeof(struct lsh_parallel_slot));
+  pfds = calloc(jobs + 1, sizeof(struct pollfd));
+  if (!slots || !pfds) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < jobs; i++) {
+    slots[i].fd = -1;
+  }
+
+  // Anything still buffered would be written again by a forked builtin.
+  fflush(stdout);
+
+  while (1) {
+    // Fill every free slot.
+    for (i = 0; i < jobs && !stop; i++) {
+      if (slots[i].job != NULL) {
+        continue;
+      }
+      arg = list ? *list : lsh_read_line(&input);
+      if (arg == NULL) {
+        stop = 1;
+        break;
+      }
+      if (list) {
+        list++;
+      }
+
+      if (lsh_parallel_start(&slots[i], lsh_parallel_args(&arena, words,
+          nwords, arg), group) == 0) {
+        running++;
+      } else {
+        failed++;
+      }
+      lsh_arena_reset(&arena);
+    }
+
+    if (running == 0) {
+      break;
+    }
+
+    // Wait for an instance to finish, or to write something.
+    pfds[0].fd = lsh_sigchld_pipe[0];
+    pfds[0].events = POLLIN;
+    for (i = 0; i < jobs; i++) {
+      pfds[i + 1].fd = slots[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+    if (poll(pfds, jobs + 1, -1) == -1 && errno != EINTR) {
+      perror("lsh: parallel");
+      break;
+    }
+
+    lsh_reap();
+    for (i = 0; i < jobs; i++) {
+      struct lsh_parallel_slot *slot = &slots[i];
+
+      if (slot->fd != -1 && pfds[i + 1].revents) {
+        lsh_parallel_collect(slot);
+      }
+      if (slot->job == NULL || slot->fd != -1 ||
+          lsh_job_state(slot->job) != LSH_DONE) {
+        continue;
+      }
+
+      n = slot->job->procs[0].status;
+      if (!WIFEXITED(n) || WEXITSTATUS(n) != 0) {
+        failed++;
+      }
+      // Don't start any more after Ctrl-C.
+      if (WIFSIGNALED(n) && WTERMSIG(n) == SIGINT) {
+        stop = 1;
+      }
+
+      lsh_write_all(STDOUT_FILENO, slot->buf, slot->len);
+      lsh_job_free(slot->job);
+      slot->job = NULL;
+      running--;
+    }
+  }
+
+  if (failed > 0) {
+    fprintf(stderr, "lsh: parallel: %d failed\n", failed);
+  }
+
+  for (i = 0; i < jobs; i++) {
+    free(slots[i].buf);
+  }
+  free(slots);
+  free(pfds);
+  free(input.buf);
+  lsh_arena_free(&arena);
+  return 1;
+}
+
+#define LSH_TOK_BUFSIZE 64
+#define LSH_TOK_DELIM " \t\r\n\a"
+
+/**
+ * @brief Split a line into tokens, in one pass and in place. Words are split
+ *        on whitespace, and on the operators '|', '<', '>', '>>' and '&'
+ *        (which needn't have spaces around them). Within a word, '\' quotes
+ *        the next character, '...' quotes everything up to the next ', and
+ *        "..." quotes everything up to the next " except for \" and \\. A #
+ *        at the start of a word makes the rest of the line a comment.
+ * @param line The line. It's overwritten with the words.
+ * @return NULL-terminated array of tokens, allocated from the command arena,
+ *         or NULL if there is a syntax error (which is reported).
+ */
+char **lsh_split_line(char *line) {
+  int bufsize = LSH_TOK_BUFSIZE;
+  int position = 0;
+  char **tokens = lsh_arena_alloc(&lsh_cmd_arena, bufsize * sizeof(char*));
+  char *r = line;
+  char *w = line;
+  char *op;
+  char c;
+  char held = '\0';
+  char quote;
+
+  while (1) {
+    // The character at r, unless the end of the last word was written over
+    // it, in which case it was held on to.
+    if (held == '\0') {
+      while (*r != '\0' && strchr(LSH_TOK_DELIM, *r) != NULL) {
+        r++;
+      }
+      c = *r;
+    } else {
+      c = held;
+      held = '\0';
+    }
+    if (c == '\0' || c == '#') {
+      break;
+    }
+
+    // Make sure there's room for this token and the NULL.
+    if (position + 1 >= bufsize) {
+      tokens = lsh_arena_grow(&lsh_cmd_arena, tokens,
+          bufsize * sizeof(char*), bufsize * 2 * sizeof(char*));
+      bufsize *= 2;
+    }
+
+    op = NULL;
+    if (c == '|') {
+      op = lsh_op_pipe;
+    } else if (c == '<') {
+      op = lsh_op_in;
+    } else if (c == '>') {
+      op = r[1] == '>' ? lsh_op_append : lsh_op_out;
+    } else if (c == '&') {
+      op = lsh_op_background;
+    }
+    if (op != NULL) {
+      tokens[position++] = op;
+      r += strlen(op);
+      continue;
+    }
+
+    // A word. It's copied back over the line as its quotes and escapes are
+    // taken out, so it can never overtake what's still to be read.
+    tokens[position++] = w;
+    quote = '\0';
+    while (*r != '\0') {
+      if (quote == '\'') {
+        if (*r == '\'') {
+          quote = '\0';
+        } else {
+          *w++ = *r;
+        }
+      } else if (quote == '"') {
+        if (*r == '"') {
+          quote = '\0';
+        } else if (*r == '\\' && (r[1] == '"' || r[1] == '\\')) {
+          *w++ = *++r;
+        } else {
+          *w++ = *r;
+        }
+      } else if (*r == '\'' || *r == '"') {
+        quote = *r;
+      } else if (*r == '\\') {
+        if (r[1] != '\0') {
+          r++;
+        }
+        *w++ = *r;
+      } else if (strchr(LSH_TOK_DELIM "|<>&", *r) != NULL) {
+        break;
+      } else {
+        *w++ = *r;
+      }
+      r++;
+    }
+
+    if (quote != '\0') {
+      fprintf(stderr, "lsh: syntax error: unterminated %c\n", quote);
+      return NULL;
+    }
+
+    // End the word. That may write over the whitespace or operator after it
+    // (if nothing was taken out of the word), so skip the one or hold on to
+    // the other.
+    c = *r;
+    *w++ = '\0';
+    if (c != '\0' && strchr(LSH_TOK_DELIM, c) != NULL) {
+      r++;
+    } else {
+      held = c;
+    }
+  }
+
+  tokens[position] = NULL;
+
+  return tokens;
+}
+
+/**
+ * @brief Loop, getting input and then executing it, until the input ends.
+ * @param in Where to get the input.
+ */
+void lsh_loop(struct lsh_input *in) {
+  struct lsh_usage mark, used;
+  char *line;
+  char **args;
+  int status;
+  double start;
+
+  do {
+    if (in->interactive) {
+      lsh_job_notify();
+      printf("> ");
+      fflush(stdout);
+    }
+    line = lsh_read_line(in);
+    if (line == NULL) {
+      if (in->interactive) {
+        printf("\n");
+      }
+      break;
+    }
+    lsh_overhead.parse = lsh_overhead.spawn = 0;
+    lsh_overhead.nspawns = 0;
+    lsh_usage_start(&mark);
+
+    start = lsh_now();
+    args = lsh_split_line(line);
+    lsh_overhead.parse = lsh_now() - start;
+    status = args ? lsh_execute(args) : 1;
+
+    lsh_usage_since(&mark, &used);
+    lsh_hist_add(&lsh_hist_real, used.real);
+    lsh_hist_add(&lsh_hist_parse, lsh_overhead.parse);
+    if (lsh_stats && args && args[0] != NULL) {
+      fprintf(stderr, "lsh: %.3fs real, %.3fs user, %.3fs sys, %ld KiB, "
+          "%ld+%ld csw, parse %.1fus, spawn %.1fus\n", used.real, used.user,
+          used.sys, used.maxrss, used.nvcsw, used.nivcsw,
+          lsh_overhead.parse * 1e6, lsh_overhead.spawn * 1e6);
+    }
+
+    lsh_arena_reset(&lsh_cmd_arena);
+    if (!in->interactive && lsh_job_list != NULL) {
+      lsh_job_notify();
+    }
+  } while(status);
+}
+
+/**
+ * @brief Main entry point.
+ * @param argc Argument count.
+ * @param argv Argument vector. `argv[1]`, if there is one, is a script to run.
+ * @return status code
+ */
+int main(int argc, char **argv) {
+  struct lsh_input in = { STDIN_FILENO, 0, 0, NULL, 0, 0, 0 };
+
+  // TODO: Load config files (if any)
+  lsh_builtins_init();
+
+  // Prompt only if there's a person to see it. Scripts are read in blocks, so
+  // one that comes in on stdin keeps it to itself: programs it runs won't see
+  // the rest of the script on theirs.
+  if (argc > 1) {
+    in.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (in.fd == -1) {
+      fprintf(stderr, "lsh: %s: %s\n", argv[1], strerror(errno));
+      return EXIT_FAILURE;
+    }
+  } else {
+    in.interactive = isatty(STDIN_FILENO);
+  }
+  lsh_jobs_init(in.interactive);
+  lsh_stats = getenv("LSH_STATS") != NULL;
+  lsh_use_fork = getenv("LSH_LAUNCH") && !strcmp(getenv("LSH_LAUNCH"), "fork");
+  lsh_use_hash = !getenv("LSH_HASH") || strcmp(getenv("LSH_HASH"), "0") != 0;
+
   // Run command loop
-  lsh_loop();
+  lsh_loop(&in);
 
   // TODO: Perform any shutdown/cleanup
+  lsh_stats_dump();
 
   return EXIT_SUCCESS;
 }